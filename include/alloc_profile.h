@@ -0,0 +1,55 @@
+#ifndef _ALLOC_PROFILE_H
+#define _ALLOC_PROFILE_H
+
+#include "stdint.h"
+
+/**
+ * Kernel heap allocation profiler, compiled in with ALLOC_PROFILE=1 (see
+ * Makefile).
+ *
+ * kmalloc, kcalloc and operator new record the return address of their
+ * caller, and kfree credits the free back to that call site. Call sites get a
+ * slot in one global table the first time they allocate, the counters for a
+ * slot live in per-core tables, so recording never takes a lock and never
+ * allocates.
+ *
+ * A tracked object carries its site and birth time in the header word that
+ * is otherwise unused while it is allocated (see memory_block_t). That is
+ * what lets a free find its site without a lookup, and lets the report walk
+ * the heap for objects that have been outstanding for too long.
+ *
+ * Sizes are what the object really takes: the rounded up slab class or heap
+ * block payload, not the size that was asked for.
+ */
+
+#define ALLOC_PROFILE_SITES 1024 /* distinct call sites tracked */
+#define ALLOC_PROFILE_TAG 0xA5ull /* top byte of the header word of a tracked object */
+#define ALLOC_PROFILE_SITE_BITS 12
+#define ALLOC_PROFILE_TIME_BITS 44 /* low bits of the birth tick, ages wrap past this */
+
+struct AllocProfileStats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t alloc_bytes;
+    uint64_t freed_bytes;
+    uint64_t window_allocs;  // since the last alloc_profile_reset, for the rate
+};
+
+// payload is what the allocator just returned, caller the return address to charge it to
+void alloc_profile_alloc(void* payload, void* caller);
+
+// called before the allocator takes payload back
+void alloc_profile_free(void* payload);
+
+/**
+ * prints the top_n call sites by live bytes over the uart, with their
+ * allocation rate since the last reset and how many of their objects are
+ * older than min_age_us. User programs can ask for it with the PROFILE_REPORT
+ * syscall.
+ */
+void alloc_profile_report(int top_n, uint64_t min_age_us);
+
+// restarts the window the allocation rates are measured over
+void alloc_profile_reset();
+
+#endif /* _ALLOC_PROFILE_H */
@@ -3,8 +3,10 @@
 
 #include "function.h"
 #include "irq.h"
+#include "lock_profile.h"
 #include "queue.h"
 #include "stdint.h"
+#include "utils.h"
 
 #ifdef USE_MONITOR
 static inline void monitor(uintptr_t addr) {
@@ -70,9 +72,53 @@ static inline void monitor(uintptr_t addr) {
 //     }
 // };
 
+/**
+ * Memory orders for Atomic<T>, passed as tags so the order is a compile time
+ * constant even in unoptimised builds (a runtime order makes gcc fall back to
+ * seq_cst). Every operation defaults to seq_cst, pick something weaker only
+ * with a reason next to it.
+ *
+ *   relaxed  atomicity only, statistics counters and hints
+ *   acquire  later accesses stay after this load, taking a lock or reference
+ *   release  earlier accesses stay before this store, publishing data
+ *   acq_rel  both, read-modify-writes that hand data over in either direction
+ *   seq_cst  one total order, needed for Dekker style "flag then check"
+ */
+namespace MemoryOrder {
+struct Relaxed {
+    static constexpr int order = __ATOMIC_RELAXED;
+    static constexpr int failure = __ATOMIC_RELAXED;
+};
+struct Acquire {
+    static constexpr int order = __ATOMIC_ACQUIRE;
+    static constexpr int failure = __ATOMIC_ACQUIRE;
+};
+struct Release {
+    static constexpr int order = __ATOMIC_RELEASE;
+    static constexpr int failure = __ATOMIC_RELAXED;
+};
+struct AcqRel {
+    static constexpr int order = __ATOMIC_ACQ_REL;
+    static constexpr int failure = __ATOMIC_ACQUIRE;
+};
+struct SeqCst {
+    static constexpr int order = __ATOMIC_SEQ_CST;
+    static constexpr int failure = __ATOMIC_SEQ_CST;
+};
+
+constexpr Relaxed relaxed{};
+constexpr Acquire acquire{};
+constexpr Release release{};
+constexpr AcqRel acq_rel{};
+constexpr SeqCst seq_cst{};
+}  // namespace MemoryOrder
+
 template <typename T>
 class Atomic {
-    volatile T value;
+    static_assert(sizeof(T) <= 8, "Atomic<T> only supports types up to 64 bits");
+
+    // natural alignment, ldxr/stxr fault on a misaligned address
+    volatile T value __attribute__((aligned(sizeof(T))));
 
    public:
     Atomic(T x) : value(x) {
@@ -84,23 +130,55 @@ class Atomic {
     operator T() const {
         return __atomic_load_n(&value, __ATOMIC_SEQ_CST);
     }
-    T fetch_add(T inc) {
-        return __atomic_fetch_add(&value, inc, __ATOMIC_SEQ_CST);
+    template <typename Order = MemoryOrder::SeqCst>
+    T fetch_add(T inc, Order = Order()) {
+        return __atomic_fetch_add(&value, inc, Order::order);
     }
-    T add_fetch(T inc) {
-        return __atomic_add_fetch(&value, inc, __ATOMIC_SEQ_CST);
+    template <typename Order = MemoryOrder::SeqCst>
+    T add_fetch(T inc, Order = Order()) {
+        return __atomic_add_fetch(&value, inc, Order::order);
     }
-    void set(T inc) {
-        return __atomic_store_n(&value, inc, __ATOMIC_SEQ_CST);
+    template <typename Order = MemoryOrder::SeqCst>
+    T fetch_or(T bits, Order = Order()) {
+        return __atomic_fetch_or(&value, bits, Order::order);
     }
-    T get(void) {
-        return __atomic_load_n(&value, __ATOMIC_SEQ_CST);
+    template <typename Order = MemoryOrder::SeqCst>
+    T fetch_and(T bits, Order = Order()) {
+        return __atomic_fetch_and(&value, bits, Order::order);
     }
-    T exchange(T v) {
+    template <typename Order = MemoryOrder::SeqCst>
+    void set(T inc, Order = Order()) {
+        return __atomic_store_n(&value, inc, Order::order);
+    }
+    template <typename Order = MemoryOrder::SeqCst>
+    T get(Order = Order()) const {
+        return __atomic_load_n(&value, Order::order);
+    }
+    template <typename Order = MemoryOrder::SeqCst>
+    T exchange(T v, Order = Order()) {
         T ret;
-        __atomic_exchange(&value, &v, &ret, __ATOMIC_SEQ_CST);
+        __atomic_exchange(&value, &v, &ret, Order::order);
         return ret;
     }
+
+    /**
+     * stores desired if the value is still expected. On failure expected is
+     * updated to what was found, the failure side uses the strongest order
+     * that is legal for a plain load.
+     */
+    template <typename Order = MemoryOrder::SeqCst>
+    bool compare_exchange(T &expected, T desired, Order = Order()) {
+        return __atomic_compare_exchange_n(&value, &expected, desired, false, Order::order,
+                                           Order::failure);
+    }
+
+    // may fail spuriously, cheaper inside a retry loop
+    template <typename Order = MemoryOrder::SeqCst>
+    bool compare_exchange_weak(T &expected, T desired, Order = Order()) {
+        return __atomic_compare_exchange_n(&value, &expected, desired, true, Order::order,
+                                           Order::failure);
+    }
+
     void monitor_value() {
 #ifdef USE_MONITOR
         monitor((uintptr_t)&value);  // Call monitor if USE_MONITOR is defined
@@ -116,27 +194,17 @@ public:
     Barrier(const Barrier&) = delete;
 
     void sync() {
-        counter.add_fetch(-1);
-	while (counter.get() != 0) {
-        asm volatile("wfe");
+        // release what we did before the barrier, acquire what the others did
+        if (counter.add_fetch(-1, MemoryOrder::acq_rel) == 0) {
+            asm volatile("sev" ::: "memory");  // wake the cores parked in wfe
+            return;
+        }
+        while (counter.get(MemoryOrder::acquire) != 0) {
+            asm volatile("wfe");
         }
     }
 };
 
-template <>
-class Atomic<uint64_t> {
-   public:
-    Atomic() = delete;
-    Atomic(uint64_t) = delete;
-};
-
-template <>
-class Atomic<int64_t> {
-   public:
-    Atomic() = delete;
-    Atomic(int64_t) = delete;
-};
-
 class Interrupts {
     static inline uint64_t getFlags() {
         uint64_t daif;
@@ -207,21 +275,31 @@ class NoLock {
 
 // extern void pause();
 
-class SpinLock {
+// spin lock implementations, build with -DSPINLOCK_IMPL=... to compare them
+#define SPINLOCK_TAS 0     // test-and-set on an exchange, unfair
+#define SPINLOCK_TICKET 1  // FIFO ticket lock, waiters sleep in wfe
+#ifndef SPINLOCK_IMPL
+#define SPINLOCK_IMPL SPINLOCK_TICKET
+#endif
+
+class TasLock {
     Atomic<bool> taken;
 
    public:
-    SpinLock() : taken(false) {
+    TasLock() : taken(false) {
     }
 
-    SpinLock(const SpinLock &) = delete;
+    TasLock(const TasLock &) = delete;
 
-    // for debugging, etc. Allows false positives
-    bool isMine() {
+    bool is_locked() {
         return taken.get();
     }
 
-    void lock(void) {
+    bool try_lock() {
+        return !taken.exchange(true);
+    }
+
+    void lock() {
         taken.monitor_value();
         while (taken.exchange(true)) {
             // iAmStuckInALoop(true);
@@ -229,53 +307,203 @@ class SpinLock {
         }
     }
 
-    void unlock(void) {
+    void unlock() {
         taken.set(false);
     }
 };
 
+/**
+ * Ticket lock, cores get the lock in the order they asked for it.
+ *
+ * A waiter takes a ticket with one atomic add and then sleeps in wfe with an
+ * exclusive load on owner, the unlock store clears its exclusive monitor and
+ * wakes it, the sev covers cores that have not armed the monitor yet. Waiters
+ * only read the owner half word, so a release costs one store instead of
+ * every core hammering the line with exchanges.
+ *
+ * A ticket can not be given back, so a lock taken from an interrupt handler
+ * must be held with interrupts off everywhere else.
+ */
+class TicketLock {
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;  // ticket being served
+            volatile uint16_t next;   // next ticket to hand out
+        } tickets;
+    };
+
+    static inline uint16_t load_exclusive(volatile uint16_t *addr) {
+        uint32_t value;
+        asm volatile("ldaxrh %w0, [%1]" : "=&r"(value) : "r"(addr) : "memory");
+        return value;
+    }
+
+   public:
+    TicketLock() : word(0) {
+    }
+
+    TicketLock(const TicketLock &) = delete;
+
+    bool is_locked() {
+        uint32_t w = __atomic_load_n(&word, __ATOMIC_RELAXED);
+        return (w & 0xFFFF) != (w >> 16);
+    }
+
+    // only takes a ticket when it would be served straight away
+    bool try_lock() {
+        uint32_t w = __atomic_load_n(&word, __ATOMIC_RELAXED);
+        if ((w & 0xFFFF) != (w >> 16)) {
+            return false;
+        }
+        return __atomic_compare_exchange_n(&word, &w, w + (1 << 16), false, __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED);
+    }
+
+    void lock() {
+        uint16_t mine = __atomic_fetch_add(&tickets.next, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&tickets.owner, __ATOMIC_ACQUIRE) == mine) {
+            return;
+        }
+        asm volatile("sevl");
+        do {
+            asm volatile("wfe" ::: "memory");
+        } while (load_exclusive(&tickets.owner) != mine);
+    }
+
+    void unlock() {
+        __atomic_store_n(&tickets.owner, (uint16_t)(tickets.owner + 1), __ATOMIC_RELEASE);
+        asm volatile("dsb ishst\n\tsev" ::: "memory");
+    }
+};
+
+#if SPINLOCK_IMPL == SPINLOCK_TICKET
+typedef TicketLock SpinLockImpl;
+#else
+typedef TasLock SpinLockImpl;
+#endif
+
+/**
+ * the lock word every spinning lock wraps, reports to the contention
+ * profiler when it is compiled in
+ */
+class RawSpinLock {
+    SpinLockImpl impl;
+#ifdef LOCK_PROFILE
+    uint64_t held_since = 0;
+#endif
+
+   public:
+    RawSpinLock() : impl() {
+    }
+
+    RawSpinLock(const RawSpinLock &) = delete;
+
+    bool is_locked() {
+        return impl.is_locked();
+    }
+
+    bool try_lock() {
+        if (!impl.try_lock()) {
+            return false;
+        }
+#ifdef LOCK_PROFILE
+        lock_profile_acquired(this, false, 0);
+        held_since = lock_profile_now();
+#endif
+        return true;
+    }
+
+    void lock() {
+#ifdef LOCK_PROFILE
+        if (impl.try_lock()) {
+            lock_profile_acquired(this, false, 0);
+        } else {
+            uint64_t start = lock_profile_now();
+            impl.lock();
+            lock_profile_acquired(this, true, lock_profile_now() - start);
+        }
+        held_since = lock_profile_now();
+#else
+        impl.lock();
+#endif
+    }
+
+    void unlock() {
+#ifdef LOCK_PROFILE
+        lock_profile_released(this, lock_profile_now() - held_since);
+#endif
+        impl.unlock();
+    }
+};
+
+class SpinLock {
+    RawSpinLock raw;
+
+   public:
+    SpinLock() : raw() {
+    }
+
+    SpinLock(const SpinLock &) = delete;
+
+    // for debugging, etc. Allows false positives
+    bool isMine() {
+        return raw.is_locked();
+    }
+
+    void lock(void) {
+        raw.lock();
+    }
+
+    bool try_lock(void) {
+        return raw.try_lock();
+    }
+
+    void unlock(void) {
+        raw.unlock();
+    }
+};
+
+/**
+ * both interrupt safe locks wait with interrupts off, a core holding a
+ * ticket must not take an interrupt that wants the same lock
+ */
 class InterruptSafeLock {
-    Atomic<bool> taken;
+    RawSpinLock raw;
     volatile bool was;
 
    public:
     Atomic<uint32_t> ref_count;
-    InterruptSafeLock() : taken(false), was(false), ref_count(0) {
+    InterruptSafeLock() : raw(), was(false), ref_count(0) {
     }
 
     InterruptSafeLock(const InterruptSafeLock &) = delete;
 
     // for debugging, etc. Allows false positives
     bool isMine() {
-        return taken.get();
+        return raw.is_locked();
     }
 
     void lock() {
-        while (true) {
-            taken.monitor_value();
-            bool wasDisabled = Interrupts::disable();
-            if (!taken.exchange(true)) {
-                was = wasDisabled;
-                return;
-            }
-            Interrupts::restore(wasDisabled);
-        }
+        bool wasDisabled = Interrupts::disable();
+        raw.lock();
+        was = wasDisabled;
     }
 
     void unlock() {
         auto wasDisabled = was;
-        taken.set(false);
+        raw.unlock();
         Interrupts::restore(wasDisabled);
     }
 };
 
 // A more flexible InterruptSafeLock
 class ISL {
-    Atomic<bool> taken;
+    RawSpinLock raw;
 
    public:
     Atomic<uint32_t> ref_count;
-    ISL() : taken(false), ref_count(0) {
+    ISL() : raw(), ref_count(0) {
     }
 
     ISL(const ISL &) = delete;
@@ -283,23 +511,18 @@ class ISL {
 
     // for debugging, etc. Allows false positives
     bool isMine() {
-        return taken.get();
+        return raw.is_locked();
     }
 
     bool lock() {
-        while (true) {
-            taken.monitor_value();
-            bool wasDisabled = Interrupts::disable();
-            if (!taken.exchange(true)) {
-                return wasDisabled;
-            }
-            Interrupts::restore(wasDisabled);
-        }
+        bool wasDisabled = Interrupts::disable();
+        raw.lock();
+        return wasDisabled;
     }
 
     // can control if interrupts are disabled or enabled when unlocking
     void unlock(bool disable) {
-        taken.set(false);
+        raw.unlock();
         if (disable) {
             disable_irq();
         } else {
@@ -315,20 +538,48 @@ struct SemaphoreNode {
 
     Function<void()> work;
     SemaphoreNode *next;
+#ifdef LOCK_PROFILE
+    uint64_t queued_at = 0;
+#endif
 };
 
+// continuations a core may nest inline before down() goes back to queuing
+#define SEMAPHORE_INLINE_DEPTH 8
+
+// how deep each core is in inline continuations, the event loop resets it
+extern uint32_t semaphoreInlineDepth[CORE_COUNT];
+
+/**
+ * Counting semaphore with continuations.
+ *
+ * A free unit is taken with a CAS on value and the continuation runs right
+ * away on the caller's stack, as long as the core is not already
+ * SEMAPHORE_INLINE_DEPTH continuations deep. Only a down that has to wait, or
+ * one over the depth budget, allocates and goes through the ready queue.
+ * spin_lock only guards blocked_queue: waiters exist only while value <= 0,
+ * and up() hands a unit straight to the oldest waiter instead of raising
+ * value.
+ *
+ * down() may run w before it returns, w must not rely on code after the
+ * down() call and down() never touches the semaphore again after running it,
+ * so w may delete it.
+ */
 class Semaphore {
+    // value comes first so the profiler can tell the semaphore from spin_lock
+    Atomic<int> value;
     SpinLock spin_lock;
     Queue<SemaphoreNode> blocked_queue;
-    volatile int value;
+#ifdef LOCK_PROFILE
+    uint64_t granted_at = 0;  // when the last unit was handed out
+#endif
+
+    bool try_take();
 
    public:
-    Semaphore(int initial_value) {
-        value = initial_value;
+    Semaphore(int initial_value) : value(initial_value) {
     }
 
-    Semaphore() {
-        value = 0;
+    Semaphore() : value(0) {
     }
 
     Semaphore(const Semaphore &) = delete;
@@ -337,7 +588,16 @@ class Semaphore {
 
     void down(Function<void()> w);
 
+    // takes a unit only if one is free right now, never queues
+    bool try_down();
+
     void kill();
+
+#ifdef LOCK_PROFILE
+    uint64_t last_grant() {
+        return granted_at;
+    }
+#endif
 };
 
 class Lock {
@@ -353,6 +613,10 @@ class Lock {
         sema.down(w);
     }
 
+    bool try_lock() {
+        return sema.try_down();
+    }
+
     void lockAndRelease(Function<void()> w) {
         this->lock([=]() mutable {
             w();
@@ -361,8 +625,67 @@ class Lock {
     }
 
     void unlock() {
+#ifdef LOCK_PROFILE
+        lock_profile_released(this, lock_profile_now() - sema.last_grant());
+#endif
         sema.up();
     }
 };
 
+#define RWLOCK_WRITER (1 << 30)  /* a writer holds the lock */
+#define RWLOCK_WAITING (1 << 29) /* someone is queued */
+
+/**
+ * Continuation based reader-writer lock with writer preference.
+ *
+ * state holds the number of readers plus the two flags above. An uncontended
+ * acquire is a single CAS on state and runs the continuation inline, like
+ * Semaphore::down. Once anyone queues, RWLOCK_WAITING turns the fast path off
+ * for new readers too, so readers can not starve a queued writer. spin_lock
+ * only guards the two queues and is the only place RWLOCK_WAITING is set or
+ * cleared.
+ *
+ * When the lock drains, a queued writer goes first, otherwise every queued
+ * reader is let in at once.
+ */
+class RWLock {
+    // state comes first so the profiler can tell the lock from spin_lock
+    Atomic<int> state;
+    SpinLock spin_lock;
+    Queue<SemaphoreNode> readers;
+    Queue<SemaphoreNode> writers;
+#ifdef LOCK_PROFILE
+    uint64_t granted_at = 0;  // when the current writer got the lock
+#endif
+
+    bool try_take(bool exclusive);
+    bool take_or_wait(bool exclusive);
+    void acquire(Function<void()>& w, bool exclusive);
+    void hand_off();
+
+   public:
+    RWLock() : state(0) {
+    }
+
+    RWLock(const RWLock &) = delete;
+
+    // many readers may hold the lock at once
+    void lock_shared(Function<void()> w) {
+        acquire(w, false);
+    }
+
+    bool try_lock_shared();
+
+    void unlock_shared();
+
+    // a writer holds the lock alone
+    void lock(Function<void()> w) {
+        acquire(w, true);
+    }
+
+    bool try_lock();
+
+    void unlock();
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include "stdint.h"
+
+/**
+ * Epoch based reclamation for read-mostly kernel structures.
+ *
+ * Readers walk the structure with acquire loads and take no lock. Writers
+ * still serialise among themselves, but a node they unlink goes to
+ * epoch_retire instead of delete and is freed only after a grace period.
+ *
+ * The quiescent point is the return to run_events: an event never keeps a
+ * pointer it read out of such a structure past its own end, so once every
+ * core has been back to run_events nothing can still hold an unlinked node.
+ * Retiring bumps the global epoch and tags the node with the new value. Each
+ * core publishes the epoch it saw at its last quiescent point, and a node is
+ * freed once every core has published one at least as new as its tag. Idle
+ * cores publish EPOCH_IDLE and hold nothing up.
+ *
+ * User space holds no kernel pointers either, so enter_user_space publishes
+ * EPOCH_IDLE too. A core running a lone user thread has its tick off and may
+ * not see run_events again for a long time; it must not hold up everyone
+ * else's frees meanwhile. Trapping back in publishes the current epoch again
+ * before the handler reads anything.
+ *
+ * Retired nodes wait on the retiring core's own list and are freed from its
+ * own quiescent points, so neither side ever takes a lock.
+ *
+ * Readers must not carry such a pointer into a continuation that may run as
+ * a later event, and irq handlers must not read these structures at all.
+ */
+
+#define EPOCH_IDLE (~0ull)
+
+struct EpochRetired {
+    void* ptr;
+    void (*free)(void*);
+    uint64_t epoch;  // freed once every core has seen this
+    EpochRetired* next;
+};
+
+// unlinked from whatever it was in, freed with free(ptr) after a grace period
+void epoch_retire_raw(void* ptr, void (*free)(void*));
+
+template <typename T>
+void epoch_retire(T* ptr) {
+    epoch_retire_raw(ptr, [](void* p) { delete (T*)p; });
+}
+
+// run_events calls this before every event
+void epoch_quiescent(int core);
+
+// the core is going to sleep or drop to user space and holds no pointers
+void epoch_idle(int core);
+
+// kernel entry from user space, leaves the epoch alone if the core was not idle
+void epoch_enter(int core);
+
+// nodes this core has retired that are still waiting for a grace period
+uint32_t epoch_pending(int core);
+
+#endif /* _EPOCH_H */
@@ -5,21 +5,31 @@
 #include "function.h"
 #include "heap.h"
 #include "locked_queue.h"
+#include "mpsc_inbox.h"
 #include "percpu.h"
 #include "printf.h"
+#include "priority.h"
 #include "process.h"
 #include "shared.h"
+#include "tcb_pool.h"
+#include "timer_wheel.h"
+#include "utils.h"
 #include "vm.h"
+#include "work_stealing_queue.h"
 
-#define CORE_COUNT 4
 #define THREAD_CPU_CONTEXT 0
 #define PRIORITY_LEVELS 5
 #define CORE_STACK_SIZE 16384
+#define READY_QUEUE_SLOTS 256
 
 #define TASK_RUNNING 0
 #define TASK_STOPPED 1
 #define TASK_KILLED 2
 
+// affinity hints for events, anything >= 0 names a core
+#define CORE_ANY -1      // no preference, queue on the creating core
+#define CORE_INHERIT -2  // follow the home core of the event that created it
+
 //-------------
 // --event.h--
 //-------------
@@ -65,18 +75,105 @@ struct TCB {
     TCB* next = nullptr;
     bool irq_was_disabled = false;  // always start with allowing interrupts
     bool kernel_event = true;
+    bool persistent = false;  // owned elsewhere, run_events must not delete it
     uint32_t state;
+    int home_core = CORE_ANY;  // core whose caches hold this event's data
+    int post_priority = KERNEL_PRIORITY;  // level to queue at once drained from an inbox
+    uint64_t wake_tick = 0;    // timer wheel tick to wake at while sleeping
     Shared<Framebuffer> frameBuffer;
     virtual void run() = 0;  // Abstract/virtual function that must be overridden
     virtual ~TCB() {};       // Allows child classes to be deleted
+
+    // events come from per-core free lists instead of the global heap
+    static void* operator new(size_t size) {
+        return tcb_pool_alloc(size);
+    }
+    static void operator delete(void* ptr, size_t size) {
+        tcb_pool_free(ptr, size);
+    }
 };
 
 struct CPU_Queues {
-    LockedQueue<TCB, SpinLock> queues[PRIORITY_LEVELS];
+    WorkStealingQueue<TCB, READY_QUEUE_SLOTS> queues[PRIORITY_LEVELS];
+    // work from other cores and irq handlers, drained by the owner
+    MpscInbox<TCB> inbox;
 };
 
 extern PerCPU<CPU_Queues> readyQueue;
 
+// bit n is set while core n is parked in wfi waiting for work
+extern Atomic<uint32_t> idleCores;
+
+extern void wake_idle_core();
+extern void wake_core(int core);
+
+// per-core preemption, the tick is skipped while nothing else is runnable here
+void start_preempt_timer(int me);
+void check_preempt_timer(int me);
+
+// cheap check for the common case where no core is asleep
+inline void notify_idle_cores() {
+    // pairs with the fence in idle, the push must be visible before we look
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (idleCores.get() != 0) {
+        wake_idle_core();
+    }
+}
+
+uint64_t get_idle_time(int core);
+void print_idle_stats();
+
+// events queued onto another core, counted on the sending core
+extern uint64_t remotePosts[CORE_COUNT];
+// events that ran somewhere other than their home core, counted on the runner
+extern uint64_t migratedEvents[CORE_COUNT];
+
+void print_affinity_stats();
+
+TCB* get_running_task(int core);
+
+/**
+ * home core of the running event, falls back to this core when the running
+ * event has no preference
+ */
+inline int current_home_core() {
+    TCB* running = get_running_task(getCoreID());
+    if (running == nullptr || running->home_core < 0) {
+        return getCoreID();
+    }
+    return running->home_core;
+}
+
+// the running event's home or CORE_ANY, what new events carry along
+inline int inherited_home_core() {
+    TCB* running = get_running_task(getCoreID());
+    return running == nullptr ? CORE_ANY : running->home_core;
+}
+
+inline int resolve_core(int core) {
+    if (core == CORE_INHERIT) return current_home_core();
+    if (core < 0 || core >= CORE_COUNT) return getCoreID();
+    return core;
+}
+
+/**
+ * every enqueue goes through here. Local work takes the lock free push, work
+ * for another core goes into its inbox and rings its mailbox if it is
+ * asleep. Neither path takes a lock.
+ */
+inline void queue_on_core(TCB* tcb, int core, int priority) {
+    int me = getCoreID();
+    if (core == me) {
+        readyQueue.mine().queues[priority].push(tcb);
+        notify_idle_cores();
+    } else {
+        remotePosts[me]++;
+        tcb->post_priority = priority;
+        readyQueue.forCPU(core).inbox.push(tcb);
+        wake_core(core);
+    }
+}
+
 extern void init_dummy_tcb();
 extern void event_loop();
 extern void enter_user_space(struct UserTCB* tcb);
@@ -113,7 +210,7 @@ struct UserTCB : public TCB {
 struct Event : public TCB {
     Function<void()> w;
     template <typename lambda>
-    Event(lambda w) : w(w) {
+    Event(lambda w) : w(K::move(w)) {
         kernel_event = true;
         state = TASK_RUNNING;
         frameBuffer = get_kernel_fb();
@@ -126,12 +223,59 @@ struct Event : public TCB {
     }
 };
 
+/**
+ * event owned by a driver and posted from its interrupt handler. Posting
+ * neither locks nor allocates, so it is safe whatever the interrupted code
+ * holds. Posts that arrive while it is still queued fold into that run, posts
+ * that arrive while it runs queue it once more afterwards.
+ */
+struct IrqEvent : public TCB {
+    Function<void()> w;
+    Atomic<uint32_t> pending;
+
+    template <typename lambda>
+    IrqEvent(int core, lambda w) : w(K::move(w)), pending(0) {
+        kernel_event = true;
+        persistent = true;
+        state = TASK_RUNNING;
+        home_core = core;
+        frameBuffer = get_kernel_fb();
+    }
+
+    // any context, queues the event on its core unless it is already queued
+    void post() {
+        if (pending.fetch_add(1) != 0) {
+            return;
+        }
+        post_priority = KERNEL_PRIORITY_HIGH;
+        readyQueue.forCPU(home_core).inbox.push(this);
+        if (home_core != (int)getCoreID()) {
+            wake_core(home_core);
+        }
+    }
+
+    void run() override {
+        uint32_t seen = pending.get();
+        Interrupts::restore(irq_was_disabled);
+        w();
+        if (pending.add_fetch(-seen) != 0) {
+            // posted again while running
+            bool was = Interrupts::disable();
+            readyQueue.forCPU(home_core).inbox.push(this);
+            if (home_core != (int)getCoreID()) {
+                wake_core(home_core);
+            }
+            Interrupts::restore(was);
+        }
+    }
+};
+
 template <typename T>
 struct EventValue : public TCB {
     Function<void(T)> w;
     T value;
     template <typename lambda>
-    EventValue(lambda w, T value) : w(w), value(value) {
+    EventValue(lambda w, T value) : w(K::move(w)), value(value) {
         kernel_event = true;
         state = TASK_RUNNING;
     }
@@ -141,54 +285,99 @@ struct EventValue : public TCB {
     }
 };
 
+/**
+ * user threads go back to the core they last ran on so their page tables and
+ * PCB are still in cache, idle cores can still steal them from there
+ */
 inline void queue_user_tcb(UserTCB* tcb, int priority) {
-    readyQueue.mine().queues[priority].add(tcb);
+    queue_on_core(tcb, resolve_core(tcb->home_core), priority);
 }
 
+// mlfq bookkeeping, both return the level the thread should be queued at
+int mlfq_wakeup(UserTCB* tcb);
+int mlfq_preempted(UserTCB* tcb);
+
+// the thread blocked before using up its quantum, so it gets a boost
 inline void queue_user_tcb(UserTCB* tcb) {
-    readyQueue.mine().queues[1].add(tcb);
+    queue_user_tcb(tcb, mlfq_wakeup(tcb));
 }
 
+// plain events run on the creating core but carry their creator's home along
 template <typename lambda>
 inline void create_event(lambda work) {
     auto tcb = new Event(work);
-    readyQueue.mine().queues[1].add(tcb);
+    tcb->home_core = inherited_home_core();
+    queue_on_core(tcb, getCoreID(), KERNEL_PRIORITY);
 }
 
 template <typename lambda>
 inline void create_event(lambda work, int priority) {
     auto tcb = new Event(work);
-    readyQueue.mine().queues[priority].add(tcb);
+    tcb->home_core = inherited_home_core();
+    queue_on_core(tcb, getCoreID(), priority);
 }
 
 template <typename T>
 inline void create_event(Function<void(T)> work,
                          T value)  // lambda that captures values
 {
-    auto tcb = new EventValue<T>(work, value);
-    readyQueue.mine().queues[1].add(tcb);
+    auto tcb = new EventValue<T>(K::move(work), value);
+    tcb->home_core = inherited_home_core();
+    queue_on_core(tcb, getCoreID(), KERNEL_PRIORITY);
 }
 
 template <typename T>
 inline void create_event(Function<void(T)> work, T value,
                          int priority)  // lambda that captures values
 {
-    auto tcb = new EventValue<T>(work, value);
-    readyQueue.mine().queues[priority].add(tcb);
+    auto tcb = new EventValue<T>(K::move(work), value);
+    tcb->home_core = inherited_home_core();
+    queue_on_core(tcb, getCoreID(), priority);
+}
+
+/**
+ * queues work on a chosen core, core is a core id, CORE_INHERIT to go back to
+ * the home core of the running event or CORE_ANY to stay here. The event
+ * keeps that core as its home so anything it creates can inherit it.
+ */
+template <typename lambda>
+inline void create_event_on(int core, lambda work, int priority = KERNEL_PRIORITY) {
+    auto tcb = new Event(work);
+    int target = resolve_core(core);
+    tcb->home_core = target;
+    queue_on_core(tcb, target, priority);
+}
+
+template <typename lambda>
+inline void create_event_inherit(lambda work, int priority = KERNEL_PRIORITY) {
+    create_event_on(CORE_INHERIT, work, priority);
+}
+
+/**
+ * runs work once delay_us has passed, from this core's timer wheel. The event
+ * keeps its creator's home core and frame buffer so periodic work carries on
+ * where it left off.
+ */
+template <typename lambda>
+inline void create_event_after(uint64_t delay_us, lambda work) {
+    auto tcb = new Event(work);
+    tcb->home_core = inherited_home_core();
+    TCB* running = get_running_task(getCoreID());
+    if (running != nullptr) {
+        tcb->frameBuffer = running->frameBuffer;
+    }
+    timer_wheel_sleep(tcb, delay_us);
 }
 
 inline void create_event_core(
     Function<void()> work,
     int core)  // Queues work on a deticated core (used for testing semaphores)
 {
-    auto tcb = new Event(work);
-    readyQueue.forCPU(core).queues[1].add(tcb);
+    create_event_on(core, K::move(work));
 }
 
 void set_return_value(UserTCB* tcb, uint64_t ret_val);
 
 UserTCB* get_running_user_tcb(int core);
 
-TCB* get_running_task(int core);
-
 #endif
\ No newline at end of file
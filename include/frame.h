@@ -3,19 +3,42 @@
 
 #include "event.h"
 #include "function.h"
+#include "future.h"
 #include "stdint.h"
 #include "vm.h"
 
 #define USED_PAGE_FLAG 0x1
 #define PINNED_PAGE_FLAG 0x2
+#define FREE_BLOCK_FLAG 0x4 /* first frame of a block on a buddy free list */
+
+/**
+ * Free frames are kept by a buddy allocator: a block of 2^order frames starts
+ * at a multiple of its size, and is merged with its buddy whenever both are
+ * free. Allocation and free are O(FRAME_ORDERS). Single frames go through a
+ * small per-core cache in front of it, so most of them never touch the lock.
+ */
+#define FRAME_MAX_ORDER 12 /* largest block is 2^12 frames, 16 MB */
+#define FRAME_ORDERS (FRAME_MAX_ORDER + 1)
+#define FRAME_CACHE_MAX 32   /* order-0 frames a core holds at most */
+#define FRAME_CACHE_BATCH 16 /* frames moved between a core and the buddy lists at once */
 
 void create_frame_table(uintptr_t start, int size);
 
 void alloc_frame(int flags, Function<void(uint64_t)> w);
 void alloc_frame(int flags, PageLocation* location, Function<void(uint64_t)> w);
+// frames come straight from the table, so the future is normally already ready
+Future<uint64_t> alloc_frame_async(int flags, PageLocation* location);
 
 bool free_frame(uintptr_t frame_addr);
 
+// count physically contiguous pinned frames, 0 if there is no such run. A
+// power of two count is aligned to its size, 512 frames make a 2 MB mapping
+uint64_t alloc_frame_run(int count);
+void free_frame_run(uintptr_t frame_addr, int count);
+
+// frames that can still be handed out, a debug path
+uint64_t free_frame_count();
+
 void pin_frame(uintptr_t frame_addr);
 
 void unpin_frame(uintptr_t frame_addr);
@@ -24,6 +47,9 @@ typedef struct Frame {
     PageLocation* contents;
     int flags;
     uint16_t pin_count;
+    uint8_t order;  // of the free block this frame starts, with FREE_BLOCK_FLAG
+    int buddy_next;
+    int buddy_prev;
 } Frame;
 
 #endif
\ No newline at end of file
@@ -21,22 +21,53 @@ enum class FileType {
     SWAP,
     UNKNOWN,
 };
-// Represents a file that is opened by any process (user or kernel).
+
+class KFile;
+
+// frees a file whose last reference is gone, see fs.cpp
+void kfile_unreferenced(KFile* file);
+
+/**
+ * Represents a file that is opened by any process (user or kernel).
+ *
+ * The reference count is a plain atomic, taking or dropping a reference is a
+ * single instruction. Dropping the last one hands the file to
+ * kfile_unreferenced, which frees it after an epoch grace period, so a
+ * lookup that found it in the open file cache can still safely look at it.
+ */
 class KFile {
    public:
     KFile() : file_type(FileType::UNKNOWN), offset(0), ref_count(1) {
     }
 
+    // caller already holds a reference, so the count can not be 0
     void increment_ref_count_atomic() {
-        adjust_ref_count_atomic(1, /* no-op */ []() {});
+        ref_count.add_fetch(1, MemoryOrder::relaxed);
+    }
+
+    /**
+     * takes a reference unless the last one is already gone, for lookups
+     * that found the file without holding a reference
+     */
+    bool try_increment_ref_count() {
+        int refs = ref_count.get(MemoryOrder::relaxed);
+        while (refs != 0) {
+            if (ref_count.compare_exchange_weak(refs, refs + 1, MemoryOrder::acquire)) {
+                return true;
+            }
+        }
+        return false;
     }
 
     void decrement_ref_count_atomic() {
-        adjust_ref_count_atomic(-1, [this]() { delete this; });
+        // release our writes to whoever frees it, acquire everyone else's
+        if (ref_count.add_fetch(-1, MemoryOrder::acq_rel) == 0) {
+            kfile_unreferenced(this);
+        }
     }
 
-    uint64_t get_ref_count() const {
-        return ref_count;
+    uint64_t get_ref_count() {
+        return ref_count.get(MemoryOrder::relaxed);
     }
 
     virtual ~KFile() = default;
@@ -45,17 +76,8 @@ class KFile {
     FileType file_type;
 
    private:
-    void adjust_ref_count_atomic(uint64_t delta, Function<void()> on_zero_refs) {
-        lock.lockAndRelease([=]() mutable {
-            ref_count += delta;
-            if (ref_count == 0) {
-                on_zero_refs();
-            }
-        });
-    }
     int offset;
-    int ref_count;
-    Lock lock;
+    Atomic<int> ref_count;
 };
 
 class FSFile : public KFile {
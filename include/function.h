@@ -1,6 +1,9 @@
 #ifndef _FUNCTION_H
 #define _FUNCTION_H
 
+#include "heap.h"
+#include "libk.h"
+
 template <typename Signature>
 class Function;  // Primary template (left undefined)
 
@@ -8,9 +11,25 @@ class Function;  // Primary template (left undefined)
 template <typename R, typename... Args>
 class Function<R(Args...)> {
    private:
+    // Callables up to this size (vtable pointer included) live inside the
+    // Function itself, anything bigger falls back to the heap. A callable
+    // that captures a Function is always bigger than a Function, so those go
+    // to the heap whatever this is, and are shared between copies instead.
+    static constexpr size_t INLINE_SIZE = 56;
+    static constexpr size_t INLINE_ALIGN = 16;
+
     // Base class for type erasure
     struct CallableBase {
         virtual R call(Args... args) = 0;
+        // copy/move an inline callable into another Function's buf
+        virtual CallableBase* clone_into(void* buf) const = 0;
+        virtual CallableBase* move_into(void* buf) = 0;
+        // reference counting, only heap callables are shared
+        virtual void retain() {
+        }
+        virtual bool release() {
+            return true;
+        }
         virtual ~CallableBase() {
         }
     };
@@ -19,44 +38,131 @@ class Function<R(Args...)> {
     // functor)
     template <typename T>
     struct Callable : CallableBase {
+        static constexpr bool fits_inline =
+            sizeof(Callable) <= INLINE_SIZE && alignof(Callable) <= INLINE_ALIGN;
+
         T func;
         Callable(const T& f) : func(f) {
         }
+        Callable(T&& f) : func(K::move(f)) {
+        }
         R call(Args... args) override {
             return func(args...);
         }
+        CallableBase* clone_into(void* buf) const override {
+            if constexpr (fits_inline) {
+                return new (buf) Callable(func);
+            } else {
+                return nullptr;  // never called, see SharedCallable
+            }
+        }
+        CallableBase* move_into(void* buf) override {
+            if constexpr (fits_inline) {
+                return new (buf) Callable(K::move(func));
+            } else {
+                return nullptr;  // heap callables are stolen, not moved
+            }
+        }
     };
 
-    CallableBase* callable;  // Pointer to callable base class
+    // A heap callable, copies of the Function share it. Continuations pass
+    // their callers' Functions along by value at every hop, so a deep copy
+    // would clone the whole chain behind them each time.
+    template <typename T>
+    struct SharedCallable : Callable<T> {
+        uint32_t refs = 1;
+
+        SharedCallable(T&& f) : Callable<T>(K::move(f)) {
+        }
+        void retain() override {
+            __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+        }
+        bool release() override {
+            return __atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0;
+        }
+    };
+
+    char storage[INLINE_SIZE] __attribute__((aligned(INLINE_ALIGN)));
+    CallableBase* callable;  // Points into storage or at a heap allocation
+
+    bool is_inline() const {
+        return (const void*)callable == (const void*)storage;
+    }
+
+    void destroy() {
+        if (callable == nullptr) return;
+        if (is_inline()) {
+            callable->~CallableBase();
+        } else if (callable->release()) {
+            delete callable;
+        }
+        callable = nullptr;
+    }
+
+    void take(Function& other) {
+        if (other.callable == nullptr) {
+            callable = nullptr;
+        } else if (other.is_inline()) {
+            callable = other.callable->move_into(storage);
+            other.destroy();
+        } else {
+            callable = other.callable;
+            other.callable = nullptr;
+        }
+    }
 
    public:
+    // empty Function, calling it does nothing
+    Function() : callable(nullptr) {
+    }
+
     // Constructor accepting any callable
     template <typename T>
-    Function(T f) : callable(new Callable<T>(f)) {
+    Function(T f) {
+        if constexpr (Callable<T>::fits_inline) {
+            callable = new (storage) Callable<T>(K::move(f));
+        } else {
+            callable = new SharedCallable<T>(K::move(f));
+        }
     }
 
-    // Move constructor
-    Function(Function&& other) : callable(other.callable) {
-        other.callable = nullptr;
+    // Move constructor, steals the heap callable or moves the inline one
+    Function(Function&& other) {
+        take(other);
     }
 
     // Move assignment
     Function& operator=(Function&& other) {
         if (this != &other) {
-            callable = other.callable;
-            other.callable = nullptr;
+            destroy();
+            take(other);
         }
         return *this;
     }
 
-    // Deleting copy constructor & copy assignment to avoid deep copying
+    // Copies of an inline callable are deep, a heap callable is shared, so
+    // copying never allocates. Captures a mutable callable changes are seen by
+    // every copy that shares it.
     Function(const Function& other) {
-        if (this != &other) {
+        if (other.callable == nullptr) {
+            callable = nullptr;
+        } else if (other.is_inline()) {
+            callable = other.callable->clone_into(storage);
+        } else {
             callable = other.callable;
+            callable->retain();
         }
     }
+    // without this, copying a non-const Function would pick the template
+    // constructor and wrap it in another Function
+    Function(Function& other) : Function(static_cast<const Function&>(other)) {
+    }
     Function& operator=(const Function&) = delete;
 
+    explicit operator bool() const {
+        return callable != nullptr;
+    }
+
     // Call operator
     R operator()(Args... args) {
         if (callable) return callable->call(args...);
@@ -64,6 +170,7 @@ class Function<R(Args...)> {
 
     // Destructor
     ~Function() {
+        destroy();
     }
 };
-#endif
\ No newline at end of file
+#endif
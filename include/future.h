@@ -0,0 +1,225 @@
+#ifndef _FUTURE_H
+#define _FUTURE_H
+
+#include "atomic.h"
+#include "function.h"
+#include "heap.h"
+#include "libk.h"
+
+/**
+ * Single-consumer futures for chaining asynchronous kernel work.
+ *
+ * A step that can finish immediately (an uncontended lock, a frame from the
+ * frame table) hands back a ready Future that carries its value inline and
+ * allocates nothing, then() on it just calls the next step. A step that has to
+ * wait (a contended lock, a disk read) hands back a Future backed by a shared
+ * state that its Promise resolves later, and the continuation runs right there
+ * in the resolver instead of being posted to the ready queue.
+ *
+ * then(f)  f returns the next Future, the result is a Future for that value
+ * done(f)  f returns nothing and ends the chain
+ *
+ * Continuations run on whichever core resolves the promise, callers that care
+ * about locality hop with create_event_on.
+ */
+
+// value for futures that only signal completion
+struct Unit {};
+
+template <typename T>
+class Future;
+
+template <typename T>
+struct FutureState {
+    SpinLock lock;
+    Atomic<uint32_t> refs;
+    bool ready;
+    T value;
+    Function<void(T)> then;
+
+    FutureState() : lock(), refs(1), ready(false) {
+    }
+
+    void retain() {
+        refs.add_fetch(1, MemoryOrder::relaxed);
+    }
+
+    void release() {
+        if (refs.add_fetch(-1, MemoryOrder::acq_rel) == 0) {
+            delete this;
+        }
+    }
+};
+
+template <typename T>
+class Promise {
+    FutureState<T>* state;
+
+   public:
+    Promise() : state(new FutureState<T>()) {
+    }
+
+    Promise(const Promise& other) : state(other.state) {
+        state->retain();
+    }
+
+    Promise& operator=(const Promise&) = delete;
+
+    ~Promise() {
+        state->release();
+    }
+
+    Future<T> get_future() {
+        return Future<T>(state);
+    }
+
+    /**
+     * publishes the value and runs the attached continuation inline, only the
+     * first resolve counts
+     */
+    void resolve(T value) {
+        Function<void(T)> then;
+        state->lock.lock();
+        if (state->ready) {
+            state->lock.unlock();
+            return;
+        }
+        state->value = value;
+        state->ready = true;
+        then = K::move(state->then);
+        state->lock.unlock();
+        if (then) then(value);
+    }
+};
+
+template <typename T>
+class Future {
+    FutureState<T>* state;  // nullptr when the value is held inline
+    T value;
+
+    template <typename U>
+    friend class Promise;
+
+    explicit Future(FutureState<T>* state) : state(state) {
+        state->retain();
+    }
+
+   public:
+    typedef T value_type;
+
+    // an already completed future, no allocation
+    explicit Future(T value) : state(nullptr), value(value) {
+    }
+
+    Future(const Future& other) : state(other.state), value(other.value) {
+        if (state) state->retain();
+    }
+
+    Future& operator=(const Future&) = delete;
+
+    ~Future() {
+        if (state) state->release();
+    }
+
+    // racy for pending futures, a false answer just means take the slow path
+    bool is_ready() const {
+        return state == nullptr || state->ready;
+    }
+
+    /**
+     * ends the chain, f runs immediately if the value is already here and
+     * otherwise from resolve()
+     */
+    void done(Function<void(T)> f) {
+        if (state == nullptr) {
+            f(value);
+            return;
+        }
+        state->lock.lock();
+        if (state->ready) {
+            state->lock.unlock();
+            f(state->value);
+            return;
+        }
+        state->then = K::move(f);
+        state->lock.unlock();
+    }
+
+    /**
+     * chains another asynchronous step. Ready futures call f straight away
+     * and return its future, pending ones get a fresh promise that is
+     * resolved by the future f returns.
+     */
+    template <typename F>
+    auto then(F f) -> decltype(f(K::declval<T>())) {
+        typedef decltype(f(K::declval<T>())) Next;
+        typedef typename Next::value_type U;
+        if (state == nullptr) {
+            return f(value);
+        }
+        if (state->ready) {
+            return f(state->value);
+        }
+        Promise<U> next;
+        Next result = next.get_future();
+        done([f, next](T value) mutable {
+            f(value).done([next](U u) mutable { next.resolve(u); });
+        });
+        return result;
+    }
+};
+
+template <typename T>
+inline Future<T> make_ready_future(T value) {
+    return Future<T>(value);
+}
+
+/**
+ * adapts a callback style call. start is handed the continuation that
+ * resolves the returned future.
+ */
+template <typename T, typename Start>
+inline Future<T> make_future(Start start) {
+    Promise<T> promise;
+    Future<T> future = promise.get_future();
+    start(Function<void(T)>([promise](T value) mutable { promise.resolve(value); }));
+    return future;
+}
+
+/**
+ * takes the lock without a trip through the ready queue when it is free, the
+ * future resolves once the lock is held
+ */
+inline Future<Unit> acquire(Lock& lock) {
+    if (lock.try_lock()) {
+        return make_ready_future(Unit{});
+    }
+    Promise<Unit> promise;
+    Future<Unit> future = promise.get_future();
+    lock.lock([promise]() mutable { promise.resolve(Unit{}); });
+    return future;
+}
+
+// acquire for the exclusive side of a reader-writer lock
+inline Future<Unit> acquire(RWLock& lock) {
+    if (lock.try_lock()) {
+        return make_ready_future(Unit{});
+    }
+    Promise<Unit> promise;
+    Future<Unit> future = promise.get_future();
+    lock.lock([promise]() mutable { promise.resolve(Unit{}); });
+    return future;
+}
+
+// resolves once the lock is held shared, alongside any other readers
+inline Future<Unit> acquire_shared(RWLock& lock) {
+    if (lock.try_lock_shared()) {
+        return make_ready_future(Unit{});
+    }
+    Promise<Unit> promise;
+    Future<Unit> future = promise.get_future();
+    lock.lock_shared([promise]() mutable { promise.resolve(Unit{}); });
+    return future;
+}
+
+#endif /* _FUTURE_H */
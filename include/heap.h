@@ -9,17 +9,43 @@
  * memory_block_t - Represents a block of memory managed by the heap. The
  * struct can be left as is, or modified for your design.
  * In the current design bit0 is the allocated bit
- * bits 1-3 are unused.
+ * bit1 marks an object owned by the slab caches (see slab.h)
+ * bit2 is set when the block right before this one is allocated
+ * bit3 marks a heap block the slab caches carve their objects from.
  * and the remaining 60 bit represent the size.
+ *
+ * A free heap block is on the free list for its size class through next,
+ * keeps the previous block of that list in the first word of its payload
+ * and repeats its size in its last word (the boundary tag), so both of its
+ * neighbours can be found and merged in O(1).
+ *
+ * next is unused while a block is allocated, the allocation profiler keeps
+ * its tag there (see alloc_profile.h).
  */
 typedef struct memory_block_struct {
     size_t block_size_alloc;
     struct memory_block_struct *next;
 } memory_block_t;
 
+#define SLAB_BLOCK 0x2
+#define PREV_ALLOC 0x4
+#define SLAB_CHUNK 0x8
+
+#define HEAP_MIN_BLOCK 48 /* header, the prev link and the footer */
+#define HEAP_LISTS 48     /* free list i holds blocks of [2^i, 2^(i+1)) bytes */
+#define HEAP_GROW_BYTES (2 * 1024 * 1024) /* least the heap takes from the frame allocator */
+#define HEAP_MAX_REGIONS 64               /* grown chunks held at once */
+
+struct HeapStats {
+    size_t free_bytes;
+    size_t largest_free;  // the biggest request that can succeed is this less a header
+    uint32_t free_blocks;
+};
+
 // extern void uinit(void *start, size_t bytes);
 // extern "C" void *kmalloc(size_t size);
 // extern "C" void kfree(void *ptr);
+uint64_t heap_allocation_count();
 
 void uinit(void *start, size_t bytes);
 void *kmalloc(size_t size);
@@ -27,9 +53,33 @@ void *kcalloc(size_t count, size_t size);
 
 void kfree(void *ptr);
 
+// walks the free lists, a debug path
+void heap_stats(HeapStats *stats);
+
+// calls visit on the header of every allocated object, slab objects
+// included, under the heap lock. A debug path, visit must not allocate
+void heap_walk(void (*visit)(memory_block_t *block));
+
+// percent of free heap memory outside the largest free block, 0 is no fragmentation
+uint32_t heap_fragmentation();
+
+// gives chunks the heap grew by back to the frame allocator once nothing in
+// them is in use, returns the bytes released
+size_t heap_trim();
+
+// the general heap behind the slab caches, kmalloc only uses it directly for
+// requests larger than SLAB_MAX_SIZE
+void *heap_alloc(size_t size, size_t flags = 0);
+void heap_free(void *ptr);
+
 void *operator new(size_t size);
 void operator delete(void *p) noexcept;
 
+// placement new, constructs into memory the caller already owns
+inline void *operator new(size_t, void *where) noexcept {
+    return where;
+}
+
 void operator delete(void *p, size_t sz);
 void *operator new[](size_t size);
 void operator delete[](void *p) noexcept;
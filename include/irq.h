@@ -11,4 +11,7 @@ extern "C" void disable_irq(void);
 extern "C" void rearm_timer(void);
 extern "C" void gic_init(void);
 
+void send_ipi(int core);
+void clear_ipi(int core);
+
 #endif /*_IRQ_H */
\ No newline at end of file
@@ -2,9 +2,13 @@
 #define _KERNEL_TESTS_H
 
 extern "C" void heapTests();
+void slab_tests();
+void heap_coalesce_tests();
+void heap_grow_tests();
 void event_loop_tests();
 void queue_test();
 void frame_alloc_tests();
+void test_frame_runs();
 void test_frame_alloc_simple();
 void test_frame_alloc_multiple();
 void test_pin_frame();
@@ -13,7 +17,18 @@ void hash_test();
 void ramfs_tests();
 void elf_load_test();
 void blocking_atomic_tests();
+void rwlock_tests();
 void ring_buffer_tests();
+void work_stealing_queue_tests();
+void ready_queue_batch_benchmark();
+void inbox_tests();
+void spinlock_benchmark();
+void atomic_tests();
+void affinity_tests();
+void wait_queue_tests();
+void timer_wheel_tests();
+void epoch_tests();
+void kfile_refcount_tests();
 void bitmap_tests();
 void swap_tests();
 void kfs_simple_test();
@@ -17,6 +17,8 @@
 #define RIGHT_ALT 6
 #define RIGHT_GUI 7
 
+#define KEYBOARD_POLL_US 8000 /* boot protocol keyboards report every 8-10ms */
+
 struct key_event {
     uint8_t modifiers;
     uint8_t keycode;
@@ -33,6 +35,7 @@ struct keyboard {
 extern struct keyboard usb_kbd;
 
 uint64_t get_keyboard_input();
+// starts polling the keyboard from timer events
 void keyboard_loop();
 
 #endif
\ No newline at end of file
@@ -25,10 +25,27 @@ void* memset(void* buf, unsigned char val, unsigned long n);
 char* strntok(char* str, char c, int n);
 
 template <typename T>
-T&& move(T&& arg) {
-    return static_cast<T&&>(arg);
+struct remove_reference {
+    typedef T type;
+};
+template <typename T>
+struct remove_reference<T&> {
+    typedef T type;
+};
+template <typename T>
+struct remove_reference<T&&> {
+    typedef T type;
+};
+
+template <typename T>
+typename remove_reference<T>::type&& move(T&& arg) {
+    return static_cast<typename remove_reference<T>::type&&>(arg);
 }
 
+// only for use in unevaluated contexts like decltype
+template <typename T>
+T&& declval() noexcept;
+
 bool check_stack();
 
 template <typename T>
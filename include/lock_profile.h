@@ -0,0 +1,53 @@
+#ifndef _LOCK_PROFILE_H
+#define _LOCK_PROFILE_H
+
+#include "stdint.h"
+
+/**
+ * Lock contention profiler, compiled in with LOCK_PROFILE=1 (see Makefile).
+ *
+ * SpinLock, InterruptSafeLock, ISL, Semaphore and Lock report every acquire,
+ * whether it had to wait, how long it waited and how long it was held, all in
+ * cntpct_el0 ticks. Each core records into its own table keyed by lock
+ * address, so recording never takes a lock and never allocates. The report
+ * merges the tables and prints the locks with the most time spent waiting.
+ *
+ * Histograms are log2 buckets: bucket i counts times in [2^i, 2^(i+1)) ticks,
+ * the last bucket also takes everything longer.
+ */
+
+#define LOCK_PROFILE_SLOTS 64   /* distinct locks tracked per core */
+#define LOCK_PROFILE_BUCKETS 16 /* log2 histogram buckets */
+#define LOCK_PROFILE_NAMES 32   /* locks that can be given a name */
+
+struct LockProfileStats {
+    const void* lock;  // nullptr for a free slot
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t wait_ticks;
+    uint64_t max_wait;
+    uint64_t releases;
+    uint64_t hold_ticks;
+    uint64_t max_hold;
+    uint32_t wait_hist[LOCK_PROFILE_BUCKETS];
+    uint32_t hold_hist[LOCK_PROFILE_BUCKETS];
+};
+
+static inline uint64_t lock_profile_now() {
+    uint64_t t;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(t));
+    return t;
+}
+
+// labels a lock in the report, unnamed locks print their address
+void lock_profile_name(const void* lock, const char* name);
+
+void lock_profile_acquired(const void* lock, bool contended, uint64_t wait_ticks);
+void lock_profile_released(const void* lock, uint64_t hold_ticks);
+
+// prints the top_n locks by total wait time over the uart, user programs can
+// ask for it with the PROFILE_REPORT syscall
+void lock_profile_report(int top_n);
+void lock_profile_reset();
+
+#endif /* _LOCK_PROFILE_H */
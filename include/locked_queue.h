@@ -9,6 +9,7 @@ class LockedQueue {
     T *volatile first = nullptr;
     T *volatile last = nullptr;
     LockType lock;
+    uint64_t acquisitions = 0;  // times the lock was taken, for benchmarks
 
    public:
     LockedQueue() : first(nullptr), last(nullptr), lock() {
@@ -17,6 +18,7 @@ class LockedQueue {
 
     void add(T *t) {
         LockGuard g{lock};
+        acquisitions++;
         t->next = nullptr;
         if (first == nullptr) {
             first = t;
@@ -28,6 +30,7 @@ class LockedQueue {
 
     T *remove() {
         LockGuard g{lock};
+        acquisitions++;
         if (first == nullptr) {
             return nullptr;
         }
@@ -39,8 +42,41 @@ class LockedQueue {
         return it;
     }
 
+    // racy, callers must still handle remove() returning nullptr
+    bool empty() {
+        return first == nullptr;
+    }
+
+    /**
+     * detaches up to max items under a single lock acquisition, the result is
+     * chained through next and ends in nullptr
+     */
+    T *remove_batch(uint32_t max) {
+        LockGuard g{lock};
+        acquisitions++;
+        auto it = first;
+        if (it == nullptr || max == 0) {
+            return nullptr;
+        }
+        auto tail = it;
+        for (uint32_t n = 1; n < max && tail->next != nullptr; n++) {
+            tail = tail->next;
+        }
+        first = tail->next;
+        if (first == nullptr) {
+            last = nullptr;
+        }
+        tail->next = nullptr;
+        return it;
+    }
+
+    uint64_t lock_acquisitions() {
+        return acquisitions;
+    }
+
     T *remove_all() {
         LockGuard g{lock};
+        acquisitions++;
         auto it = first;
         first = nullptr;
         last = nullptr;
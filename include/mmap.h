@@ -4,6 +4,7 @@
 #include "event.h"
 #include "fs.h"
 #include "function.h"
+#include "future.h"
 #include "process.h"
 #include "vm.h"
 
@@ -33,6 +34,14 @@ void mmap(PCB* pcb, uint64_t uvaddr, int prot, int flags, KFile* file, uint64_t
 void mmap_page(PCB* pcb, uint64_t uvaddr, int prot, int flags, KFile* file, uint64_t offset,
                uint64_t id, Function<void(void)> w);
 void load_location(PageLocation* location, Function<void(uint64_t)> w);
+
+// future versions of the above, continuations run inline instead of as new events
+Future<uint64_t> load_mmapped_page_async(PCB* pcb, uint64_t uvaddr);
+Future<uint64_t> load_location_async(PageLocation* location);
 int unreserved_id();
 
+// page fault latency/allocation accounting, lives in page_fault.cpp
+void reset_page_fault_stats();
+void print_page_fault_stats();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef _MPSC_INBOX_H
+#define _MPSC_INBOX_H
+
+#include "stdint.h"
+
+/**
+ * Lock free multi-producer single-consumer inbox.
+ *
+ * Producers push with a single CAS on head and never allocate, the items are
+ * linked through their own next field, so it is safe to post from interrupt
+ * handlers and from other cores no matter what locks the interrupted code
+ * holds. The owner takes everything at once with an exchange and gets it back
+ * in posting order. Taking the whole list instead of single items means the
+ * CAS can never see a recycled head (no ABA).
+ *
+ * Ownership rules:
+ *   push     - any core, any context
+ *   take_all - only ever called by the owning core
+ */
+template <typename T>
+class MpscInbox {
+    T* volatile head = nullptr;  // newest first
+
+   public:
+    MpscInbox() : head(nullptr) {
+    }
+    MpscInbox(const MpscInbox&) = delete;
+
+    /**
+     * returns true if the inbox was empty before, only then can the owner
+     * have gone to sleep without seeing it
+     */
+    bool push(T* t) {
+        T* old = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            t->next = old;
+        } while (!__atomic_compare_exchange_n(&head, &old, t, true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+        return old == nullptr;
+    }
+
+    /**
+     * owner only, detaches every item posted so far and returns them oldest
+     * first, chained through next
+     */
+    T* take_all() {
+        T* it = __atomic_exchange_n(&head, nullptr, __ATOMIC_ACQUIRE);
+        T* fifo = nullptr;
+        while (it != nullptr) {
+            T* next = it->next;
+            it->next = fifo;
+            fifo = it;
+            it = next;
+        }
+        return fifo;
+    }
+
+    // racy, only a hint
+    bool empty() {
+        return __atomic_load_n(&head, __ATOMIC_RELAXED) == nullptr;
+    }
+};
+
+#endif /* _MPSC_INBOX_H */
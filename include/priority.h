@@ -0,0 +1,15 @@
+#ifndef _PRIORITY_H
+#define _PRIORITY_H
+
+// scheduling bands, lower levels are always served first. Kernel
+// continuations get their own band so user threads can never starve them.
+#define KERNEL_PRIORITY_HIGH 0
+#define KERNEL_PRIORITY 1
+#define USER_PRIORITY_HIGH 2  // threads that keep blocking before their quantum ends
+#define USER_PRIORITY_DEFAULT 3
+#define USER_PRIORITY_LOW 4  // cpu hogs that keep getting preempted
+
+// every this many picks a core serves the lowest user band first
+#define MLFQ_AGING_INTERVAL 16
+
+#endif /* _PRIORITY_H */
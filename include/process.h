@@ -5,16 +5,43 @@
 #include "event.h"
 #include "file_table.h"
 #include "printf.h"
+#include "priority.h"
 #include "shared.h"
 #include "vm.h"
 #include "timer.h"
+#include "wait_queue.h"
 
 #define NR_TASKS (1 << 8)
 
+// nice shifts a process up or down the user priority bands
+#define NICE_MIN -2
+#define NICE_MAX 2
+
+/**
+ * pid -> PCB. Lookups take no lock: a slot is only ever set to a fully built
+ * PCB, and a PCB taken out of it is freed through epoch_retire, so whatever
+ * task_lookup returns stays valid until the calling event ends.
+ */
 extern struct PCB* task[NR_TASKS];
-extern int curr_task;
+extern int curr_task;  // where the search for a free pid starts, only a hint
 extern int task_cnt;
 
+static inline struct PCB* task_lookup(int pid) {
+    if (pid < 0 || pid >= NR_TASKS) {
+        return nullptr;
+    }
+    return __atomic_load_n(&task[pid], __ATOMIC_ACQUIRE);
+}
+
+// claims a free pid for pcb and publishes it, sets pcb->pid
+void publish_task(struct PCB* pcb);
+
+// publishes pcb under pid, whatever held pid before is retired
+void publish_task_at(struct PCB* pcb, int pid);
+
+// frees pid, the PCB itself is deleted once no lookup can still hold it
+void retire_task(struct PCB* pcb);
+
 enum sig_val {
     SIGHUP = 1,
     SIGINT = 2,
@@ -49,6 +76,9 @@ enum sig_val {
     SIGSYS = 31
 };
 
+// bit for sig in PCB::pending_signals
+#define SIGNAL_BIT(sig) (1u << (sig))
+
 struct Signal {
     int val;
     int from_pid;
@@ -65,6 +95,9 @@ struct PCB {
     int pid;
     PageTable* page_table;
     SupplementalPageTable* supp_page_table;
+    // one bit per pending signal, the scheduler only ever does a single load
+    Atomic<uint32_t> pending_signals;
+    // records for signals that carry a payload (SIGCHLD), the rest are just bits
     LockedQueue<Signal, SpinLock>* sigs;
     Semaphore* waiting_parent;
     PCB* parent;
@@ -77,20 +110,21 @@ struct PCB {
     uint64_t start_time;
     Shared<Framebuffer> frameBuffer;
 
+    // scheduling, priority is the mlfq level the process has earned
+    int priority;
+    int nice;
+
+    // set by SIGSTOP, the thread parks on stopped the next time it is picked
+    volatile bool stop_requested;
+    WaitQueue stopped;
+
     uint64_t data_end;
 
     // Files and stuff.
     FileTable* file_table;
     int cwd;  // 0 is root.
 
-    PCB() : cwd(0 /* root */) {
-        K::assert(task_cnt < NR_TASKS, "we are out of task space!\n");
-        while (task[curr_task] != nullptr) {
-            curr_task = (curr_task + 1) % NR_TASKS;
-        }
-        task[curr_task] = this;
-        task_cnt += 1;
-        pid = curr_task;
+    PCB() : pending_signals(0), cwd(0 /* root */) {
         page_table = new PageTable;
         supp_page_table = new SupplementalPageTable;
         file_table = new FileTable;
@@ -101,12 +135,12 @@ struct PCB {
         frameBuffer = nullptr;
         data_end = ~VA_START - (8192 * PAGE_SIZE); /* preferrable set this after bss segment */
         start_time = get_systime();
+        priority = USER_PRIORITY_DEFAULT;
+        nice = 0;
+        stop_requested = false;
+        publish_task(this);
     }
-    PCB(int id) {
-        if (task[pid]) delete task[pid];
-        task_cnt++;
-        pid = id;
-        task[pid] = this;
+    PCB(int id) : pending_signals(0) {
         page_table = new PageTable;
         supp_page_table = new SupplementalPageTable;
         file_table = new FileTable;
@@ -117,10 +151,45 @@ struct PCB {
         before = nullptr;
         data_end = ~VA_START - (8192 * PAGE_SIZE);
         start_time = get_systime();
+        priority = USER_PRIORITY_DEFAULT;
+        nice = 0;
+        stop_requested = false;
+        publish_task_at(this, id);
+    }
+
+    // level the scheduler queues this process at once nice is applied
+    int effective_priority() {
+        int level = priority + nice;
+        if (level < USER_PRIORITY_HIGH) return USER_PRIORITY_HIGH;
+        if (level > USER_PRIORITY_LOW) return USER_PRIORITY_LOW;
+        return level;
     }
 
     void raise_signal(Signal* s) {
-        sigs->add(s);
+        int sig = s->val;
+        if (sig == SIGCHLD) {
+            sigs->add(s);
+        } else {
+            delete s;
+        }
+        pending_signals.fetch_or(SIGNAL_BIT(sig));
+    }
+
+    bool signal_pending(int sig) {
+        return (pending_signals.get() & SIGNAL_BIT(sig)) != 0;
+    }
+
+    /**
+     * takes the oldest SIGCHLD record, the bit is cleared once the queue
+     * drains and set again if a child exited in between
+     */
+    Signal* take_child_signal() {
+        Signal* s = sigs->remove();
+        if (s != nullptr && sigs->empty()) {
+            pending_signals.fetch_and(~SIGNAL_BIT(SIGCHLD));
+            if (!sigs->empty()) pending_signals.fetch_or(SIGNAL_BIT(SIGCHLD));
+        }
+        return s;
     }
 
     void add_waiting_parent(Semaphore* s) {
@@ -158,7 +227,11 @@ struct PCB {
     }
 
     ~PCB() {
-        task_cnt--;
+        // a PCB deleted outright instead of retired must not leave its slot behind
+        PCB* self = this;
+        __atomic_compare_exchange_n(&task[pid], &self, nullptr, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&task_cnt, 1, __ATOMIC_RELAXED);
         delete page_table;
         delete supp_page_table;
         delete sigs;
@@ -171,4 +244,16 @@ void fork(struct UserTCB* tcb);
 
 void kill_process(struct PCB* pcb);
 
+/**
+ * the process is done: its parent gets a SIGCHLD and reaps it in wait, an
+ * orphan nobody will wait for is retired straight away
+ */
+void exit_process(struct PCB* pcb, int status);
+
+// frees the pid of an exited child once its parent has collected it
+void reap_child(int pid);
+
+// delivers s to target, SIGSTOP/SIGCONT/SIGKILL also park or wake its thread
+void send_signal(struct PCB* target, Signal* s);
+
 #endif /*_PROCESS_H_*/
\ No newline at end of file
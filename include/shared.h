@@ -1,13 +1,16 @@
 #ifndef _shared_h_
 #define _shared_h_
 
+#include "atomic.h"
+
 template <typename T>
 class Shared {
     T* ptr;
 
     void drop() {
         if (ptr != nullptr) {
-            auto new_count = ptr->ref_count.add_fetch(-1);
+            // release our writes to the object, the last owner acquires everyone's
+            auto new_count = ptr->ref_count.add_fetch(-1, MemoryOrder::acq_rel);
             if (new_count == 0) {
                 delete ptr;
                 ptr = nullptr;
@@ -17,7 +20,8 @@ class Shared {
 
     void add() {
         if (ptr != nullptr) {
-            ptr->ref_count.add_fetch(1);
+            // we already hold a reference, nothing to order against
+            ptr->ref_count.add_fetch(1, MemoryOrder::relaxed);
         }
     }
 
@@ -0,0 +1,44 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "stdint.h"
+
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE 2048     /* bigger requests go to the general heap */
+#define SLAB_CLASSES 8         /* powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE */
+#define SLAB_CHUNK_BYTES 16384 /* most a class takes from the heap when it grows */
+#define SLAB_MAX_BATCH 64      /* objects moved between a core and the depot at once */
+
+/**
+ * Size-class slab caches in front of the general heap.
+ *
+ * Every kmalloc up to SLAB_MAX_SIZE is rounded up to a power of two and
+ * served from the current core's free list for that class, the same scheme
+ * tcb_pool uses for events: a core only touches the shared depot once per
+ * batch, and only grows a class from the heap when the depot is empty too.
+ * Allocation and free are O(1) and take no lock on the common path.
+ *
+ * Objects keep the memory_block_t header kmalloc blocks have, with
+ * SLAB_BLOCK set, so kfree can tell them apart and the free lists link
+ * through the header. Like kfree, a slab free zeroes the payload. Memory a
+ * class has taken from the heap stays with that class.
+ */
+
+// the class a request of size bytes is served from, size <= SLAB_MAX_SIZE
+int slab_class(size_t size);
+
+// payload size of objects in class cls
+static inline size_t slab_class_size(int cls) {
+    return (size_t)SLAB_MIN_SIZE << cls;
+}
+
+void slab_init();
+void* slab_alloc(size_t size);
+
+// ptr must be a payload slab_alloc returned
+void slab_free(void* ptr);
+
+// allocations served from the slabs so far, summed over cores
+uint64_t slab_allocation_count();
+
+#endif /* _SLAB_H */
@@ -4,6 +4,7 @@
 #include "atomic.h"
 #include "bitmap.h"
 #include "function.h"
+#include "future.h"
 #include "hash.h"
 #include "partition.h"
 #include "printf.h"
@@ -34,6 +35,9 @@ class Swap {
     void clear_swap(uint64_t swap_id, Function<void(void)> w);
     void get_swap_id(Function<void(uint64_t)> w);
 
+    Future<Unit> read_swap_async(uint64_t swap_id, void* kvaddr);
+    Future<uint64_t> get_swap_id_async();
+
     long swap_id_to_sector(uint64_t swap_id);
 
     /**
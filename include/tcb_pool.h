@@ -0,0 +1,19 @@
+#ifndef _TCB_POOL_H
+#define _TCB_POOL_H
+
+#include "stdint.h"
+
+#define TCB_POOL_OBJECT_SIZE 128 /* fits Event and EventValue, UserTCB goes to the heap */
+#define TCB_POOL_BATCH 32        /* objects moved between a core and the depot at once */
+#define TCB_POOL_MAX_CACHED (2 * TCB_POOL_BATCH)
+
+/**
+ * Per-core free lists for TCB sized objects. Allocating and freeing an event
+ * only touches the current core's list, the shared depot (and kmalloc behind
+ * it) is only hit once per TCB_POOL_BATCH operations. Objects larger than
+ * TCB_POOL_OBJECT_SIZE fall straight through to kmalloc/kfree.
+ */
+void* tcb_pool_alloc(size_t size);
+void tcb_pool_free(void* ptr, size_t size);
+
+#endif /* _TCB_POOL_H */
@@ -3,10 +3,21 @@
 
 #include "stdint.h"
 
+// default user time slice, change at runtime with set_preempt_quantum
+#define PREEMPT_QUANTUM_US 10000
+
 void timer_init(void);
 void local_timer_init(void);
 extern "C" void handle_timer_irq(void);
 void wait_msec(unsigned int);
 uint64_t get_systime();
+uint64_t get_ticks();
+uint64_t ticks_to_us(uint64_t ticks);
+
+// per-core CNTP timer used for preemption
+void set_preempt_quantum(uint64_t us);
+uint64_t get_preempt_quantum();
+void arm_preempt_timer();
+void disarm_preempt_timer();
 
 #endif /*_TIMER_H */
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include "stdint.h"
+
+#define TIMER_WHEEL_TICK_US 1000 /* resolution of delayed events and sleeps */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4 /* 64^4 ticks, a bit over 4.5 hours at 1ms */
+
+struct TCB;
+
+/**
+ * Hierarchical timing wheel, one per core.
+ *
+ * Level 0 has a slot per tick, each level above covers 64 times the span of
+ * the one below. A TCB is filed under the level whose span fits its remaining
+ * delay and moves down a level each time the level below wraps, so insert and
+ * expiry are O(1) and a core only pays for timers that actually exist.
+ *
+ * TCBs are chained through TCB::next, a sleeping TCB is on no ready queue so
+ * the link is free. Only the owning core touches its wheel, always with
+ * interrupts masked.
+ */
+class TimerWheel {
+    TCB* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t now;    // last tick that has been processed
+    uint32_t count;  // TCBs on the wheel
+
+    void place(TCB* tcb);
+    void cascade(int level);
+
+   public:
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+
+    // files tcb to expire at the absolute tick tcb->wake_tick
+    void add(TCB* tcb);
+
+    /**
+     * processes every tick up to and including until, returns the expired
+     * TCBs chained through next
+     */
+    TCB* advance(uint64_t until);
+
+    // the next tick worth waking up for, only meaningful when not empty
+    uint64_t next_expiry();
+
+    uint64_t current() const {
+        return now;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+};
+
+// ticks of the wheel since boot
+uint64_t timer_wheel_now();
+uint64_t us_to_wheel_ticks(uint64_t us);
+
+/**
+ * puts tcb on this core's wheel, it is queued again once delay_us has passed.
+ * Kernel events go back on their home core, user threads through
+ * queue_user_tcb.
+ */
+void timer_wheel_sleep(TCB* tcb, uint64_t delay_us);
+
+// CNTV interrupt, queues whatever expired and rearms for the next timer
+void timer_wheel_irq();
+
+#endif /* _TIMER_WHEEL_H */
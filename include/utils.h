@@ -1,6 +1,8 @@
 #ifndef _BOOT_H
 #define _BOOT_H
 
+#define CORE_COUNT 4
+
 extern "C" void delay(unsigned long);
 extern "C" void put32(volatile unsigned int*, unsigned int);
 extern "C" unsigned int get32(volatile unsigned int*);
@@ -87,6 +87,7 @@
 #include "atomic.h"
 #include "fs.h"
 #include "function.h"
+#include "future.h"
 #include "hash.h"
 #include "libk.h"
 #include "printf.h"
@@ -124,7 +125,12 @@ class PageTable {
     bool unmap_vaddr(uint64_t vaddr);
     void alloc_pgd(Function<void()> w);
 
+    // same as map_vaddr, completes inline unless the frame table runs dry
+    Future<Unit> map_vaddr_async(uint64_t vaddr, uint64_t paddr, uint64_t page_attributes);
+
    private:
+    Future<PageTableLevel*> table_at(uint64_t* descriptor, uint64_t page_attributes);
+
     void map_vaddr_pgd(uint64_t vaddr, uint64_t paddr, uint64_t page_attributes,
                        Function<void()> w);
 
@@ -239,8 +245,8 @@ struct PageLocation {
 class SupplementalPageTable {
    public:
     HashMap<uint64_t, LocalPageLocation*> map;
-    Lock lock;  // only lock the map with this, Page location and LocalPageLocation are locked
-                // locally;
+    RWLock lock;  // only lock the map with this, Page location and LocalPageLocation are
+                  // locked locally. Lookups take it shared, changes to the map exclusive
 
     SupplementalPageTable() : map(uint64_t_hash, uint64_t_equals, 100) {
     }
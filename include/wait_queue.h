@@ -0,0 +1,52 @@
+#ifndef _WAIT_QUEUE_H
+#define _WAIT_QUEUE_H
+
+#include "atomic.h"
+#include "stdint.h"
+
+struct TCB;
+struct UserTCB;
+
+/**
+ * UserTCBs that cannot run until something wakes them. Sleepers are taken off
+ * the ready queues entirely so the scheduler never looks at them, the wake
+ * source (signal delivery, a semaphore continuation, an I/O completion) puts
+ * them back with queue_user_tcb. Scheduling cost no longer depends on how many
+ * processes are blocked.
+ */
+class WaitQueue {
+    InterruptSafeLock lock;
+    TCB* first = nullptr;
+    TCB* last = nullptr;
+    uint32_t count = 0;
+
+    void add(TCB* tcb);
+    UserTCB* remove();
+
+   public:
+    WaitQueue() : lock() {
+    }
+    WaitQueue(const WaitQueue&) = delete;
+
+    void sleep(UserTCB* tcb);
+
+    /**
+     * sleeps only if condition is still set once the queue is locked. Wakers
+     * clear the condition before calling wake_*, so a wakeup that races with
+     * going to sleep is never lost. Returns true if tcb went to sleep.
+     */
+    bool sleep_if(UserTCB* tcb, volatile bool& condition);
+
+    bool wake_one();
+    uint32_t wake_all();
+
+    // wakes every sleeper as TASK_KILLED so the scheduler frees it
+    uint32_t kill_all();
+
+    // racy, only for stats
+    uint32_t size() {
+        return count;
+    }
+};
+
+#endif /* _WAIT_QUEUE_H */
@@ -0,0 +1,184 @@
+#ifndef _WORK_STEALING_QUEUE_H
+#define _WORK_STEALING_QUEUE_H
+
+#include "atomic.h"
+#include "libk.h"
+#include "locked_queue.h"
+#include "stdint.h"
+
+#define OVERFLOW_BATCH 32 /* posted TCBs pulled into the ring per lock */
+
+/**
+ * Per-core run queue that other cores can steal from.
+ *
+ * The owning core pushes at the tail and pops from the head without taking a
+ * lock, the only shared write on its fast path is a single uncontended CAS on
+ * head. Thieves take half of the ring from the head with one CAS and copy it
+ * straight into their own ring, so a steal moves a batch of work instead of a
+ * single TCB.
+ *
+ * Pops stay FIFO on purpose: a preempted UserTCB is pushed at the tail and must
+ * not be handed straight back to the core that just preempted it.
+ *
+ * TCBs pushed while the ring is full spill into a locked overflow queue and
+ * are pulled back in batches, one overflow lock acquisition brings over up to
+ * batch TCBs. That happens whenever the ring runs dry, and at least once every
+ * N pops, so a core that keeps re-pushing its own threads can not starve what
+ * spilled. Once in the ring they are dispatched lock free and an idle core can
+ * still steal them back.
+ *
+ * Ownership rules:
+ *   push/pop/steal_from - only ever called by the owning core
+ *   (other cores post through the per-core inbox, see queue_on_core)
+ */
+template <typename T, uint32_t N>
+class WorkStealingQueue {
+    static_assert((N & (N - 1)) == 0, "WorkStealingQueue size must be a power of two");
+
+    T* volatile slots[N];
+    volatile uint32_t head = 0;  // next slot to pop/steal, advanced by CAS
+    volatile uint32_t tail = 0;  // next slot to push, written by the owner only
+
+    // work pushed while the ring was full
+    LockedQueue<T, SpinLock> overflow;
+    uint32_t batch = N < OVERFLOW_BATCH ? N : OVERFLOW_BATCH;
+    uint32_t pops = 0;  // owner only, paces the overflow polls
+
+    /**
+     * moves up to a batch of spilled work to the tail of the ring, as much as
+     * there is room for
+     */
+    void refill() {
+        uint32_t t = tail;
+        uint32_t room = N - (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE));
+        if (room == 0) {
+            return;
+        }
+        T* it = overflow.remove_batch(room < batch ? room : batch);
+        uint32_t n = 0;
+        while (it != nullptr) {
+            T* next = it->next;
+            slots[(t + n) % N] = it;
+            n++;
+            it = next;
+        }
+        __atomic_store_n(&tail, t + n, __ATOMIC_RELEASE);
+    }
+
+    T* pop_ring() {
+        while (true) {
+            uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            uint32_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            if (t == h) {
+                return nullptr;
+            }
+            T* it = slots[h % N];
+            if (__atomic_compare_exchange_n(&head, &h, h + 1, false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+                return it;
+            }
+        }
+    }
+
+   public:
+    WorkStealingQueue() : overflow() {
+    }
+    WorkStealingQueue(const WorkStealingQueue&) = delete;
+
+    /**
+     * owner only, adds to the tail of the ring
+     */
+    void push(T* t) {
+        bool was = Interrupts::disable();
+        uint32_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        uint32_t tl = tail;
+        if (tl - h < N) {
+            slots[tl % N] = t;
+            __atomic_store_n(&tail, tl + 1, __ATOMIC_RELEASE);
+        } else {
+            overflow.add(t);
+        }
+        Interrupts::restore(was);
+    }
+
+    /**
+     * owner only, takes from the head of the ring and refills it from the
+     * overflow queue once it runs dry or every N pops
+     */
+    T* pop() {
+        bool was = Interrupts::disable();
+        T* it = pop_ring();
+        if (it == nullptr) {
+            if (!overflow.empty()) {
+                refill();
+                it = pop_ring();
+            }
+        } else if (++pops % N == 0 && !overflow.empty()) {
+            // the pop just made room
+            refill();
+        }
+        Interrupts::restore(was);
+        return it;
+    }
+
+    /**
+     * owner only, grabs half of victim's ring into this ring in a single CAS
+     * on the victim's head. Only steals into an empty ring so the batch always
+     * fits. Returns how many TCBs were moved.
+     */
+    uint32_t steal_from(WorkStealingQueue& victim) {
+        uint32_t t = tail;
+        if (t != __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+
+        while (true) {
+            uint32_t h = __atomic_load_n(&victim.head, __ATOMIC_ACQUIRE);
+            uint32_t vt = __atomic_load_n(&victim.tail, __ATOMIC_ACQUIRE);
+            uint32_t n = vt - h;
+            n = n - n / 2;
+            if (n == 0) {
+                break;
+            }
+            if (n > N / 2) {
+                continue;  // head and tail read across a concurrent update, retry
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                slots[(t + i) % N] = victim.slots[(h + i) % N];
+            }
+            if (__atomic_compare_exchange_n(&victim.head, &h, h + n, false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+                __atomic_store_n(&tail, t + n, __ATOMIC_RELEASE);
+                return n;
+            }
+        }
+
+        // ring was empty, try to take a single spilled TCB instead
+        if (!victim.overflow.empty()) {
+            T* it = victim.overflow.remove();
+            if (it != nullptr) {
+                push(it);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // how many posted TCBs a refill takes at once, 1 is a lock per dispatch
+    void set_batch(uint32_t n) {
+        batch = n == 0 ? 1 : (n > N ? N : n);
+    }
+
+    uint64_t lock_acquisitions() {
+        return overflow.lock_acquisitions();
+    }
+
+    // racy, only a hint for the scheduler
+    bool empty() {
+        return __atomic_load_n(&tail, __ATOMIC_RELAXED) ==
+                   __atomic_load_n(&head, __ATOMIC_RELAXED) &&
+               overflow.empty();
+    }
+};
+
+#endif /* _WORK_STEALING_QUEUE_H */
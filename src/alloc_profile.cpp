@@ -0,0 +1,224 @@
+#include "alloc_profile.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "libk.h"
+#include "percpu.h"
+#include "printf.h"
+#include "timer.h"
+
+#ifdef ALLOC_PROFILE
+
+struct AllocProfileTable {
+    AllocProfileStats sites[ALLOC_PROFILE_SITES];  // indexed like siteCallers
+    uint64_t dropped;  // allocations from call sites that found the site table full
+};
+
+static PerCPU<AllocProfileTable> tables;
+
+// call site of each slot, 0 for a free one. Slots are claimed once and never reused
+static uintptr_t siteCallers[ALLOC_PROFILE_SITES];
+
+static uint64_t windowStart = 0;
+
+// merged view for the report, only one core should report at a time
+struct AllocProfileSite {
+    uintptr_t caller;
+    AllocProfileStats stats;
+    uint64_t old_objects;
+    uint64_t old_bytes;
+};
+static AllocProfileSite merged[ALLOC_PROFILE_SITES];
+static uint64_t reportNow;
+static uint64_t reportMinAge;
+
+#define TIME_MASK ((1ull << ALLOC_PROFILE_TIME_BITS) - 1)
+#define SITE_MASK ((1ull << ALLOC_PROFILE_SITE_BITS) - 1)
+
+static uint64_t make_tag(int site, uint64_t ticks) {
+    return (ALLOC_PROFILE_TAG << 56) | ((uint64_t)site << ALLOC_PROFILE_TIME_BITS) |
+           (ticks & TIME_MASK);
+}
+
+static bool is_tag(uint64_t tag) {
+    // free list links are kernel addresses or nullptr, neither starts with the tag byte
+    return (tag >> 56) == ALLOC_PROFILE_TAG;
+}
+
+static int site_of(uint64_t tag) {
+    return (tag >> ALLOC_PROFILE_TIME_BITS) & SITE_MASK;
+}
+
+static uint64_t payload_bytes(memory_block_t* block) {
+    size_t size = block->block_size_alloc & ~(ALIGNMENT - 1);
+    // slab headers hold the payload size, heap headers the whole block
+    return (block->block_size_alloc & SLAB_BLOCK) ? size : size - sizeof(memory_block_t);
+}
+
+/**
+ * open addressing on the call site, a slot is claimed with a cas so cores
+ * never need a lock to add a site
+ */
+static int site_index(uintptr_t caller) {
+    uint64_t h = (caller >> 2) * 0x9E3779B97F4A7C15ull;
+    uint32_t start = h >> 54;  // top 10 bits, ALLOC_PROFILE_SITES == 1024
+    for (uint32_t i = 0; i < ALLOC_PROFILE_SITES; i++) {
+        uint32_t slot = (start + i) % ALLOC_PROFILE_SITES;
+        uintptr_t seen = __atomic_load_n(&siteCallers[slot], __ATOMIC_ACQUIRE);
+        if (seen == 0) {
+            if (__atomic_compare_exchange_n(&siteCallers[slot], &seen, caller, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return slot;
+            }
+        }
+        if (seen == caller) return slot;
+    }
+    return -1;
+}
+
+void alloc_profile_alloc(void* payload, void* caller) {
+    memory_block_t* block = (memory_block_t*)payload - 1;
+    int site = site_index((uintptr_t)caller);
+    uint64_t size = payload_bytes(block);
+
+    bool was = Interrupts::disable();
+    AllocProfileTable& table = tables.mine();
+    if (site < 0) {
+        table.dropped++;
+    } else {
+        AllocProfileStats& s = table.sites[site];
+        s.allocs++;
+        s.window_allocs++;
+        s.alloc_bytes += size;
+    }
+    Interrupts::restore(was);
+
+    block->next = site < 0 ? nullptr : (memory_block_t*)make_tag(site, get_ticks());
+}
+
+void alloc_profile_free(void* payload) {
+    memory_block_t* block = (memory_block_t*)payload - 1;
+    uint64_t tag = (uint64_t)block->next;
+    if (!is_tag(tag)) {
+        return;  // its site was never known
+    }
+    uint64_t size = payload_bytes(block);
+
+    bool was = Interrupts::disable();
+    AllocProfileStats& s = tables.mine().sites[site_of(tag)];
+    s.frees++;
+    s.freed_bytes += size;
+    Interrupts::restore(was);
+}
+
+// runs under the heap lock, must not allocate
+static void count_if_old(memory_block_t* block) {
+    uint64_t tag = (uint64_t)block->next;
+    if (!is_tag(tag)) {
+        return;
+    }
+    uint64_t age = (reportNow - tag) & TIME_MASK;
+    if (ticks_to_us(age) >= reportMinAge) {
+        AllocProfileSite& site = merged[site_of(tag)];
+        site.old_objects++;
+        site.old_bytes += payload_bytes(block);
+    }
+}
+
+static uint64_t live_bytes(const AllocProfileSite& site) {
+    return site.stats.alloc_bytes - site.stats.freed_bytes;
+}
+
+/**
+ * racy snapshot of every core's table, good enough for a report. Sites are
+ * ranked by live bytes.
+ */
+void alloc_profile_report(int top_n, uint64_t min_age_us) {
+    int count = 0;
+    uint64_t dropped = 0;
+    K::memset(merged, 0, sizeof(merged));
+    for (int slot = 0; slot < ALLOC_PROFILE_SITES; slot++) {
+        merged[slot].caller = __atomic_load_n(&siteCallers[slot], __ATOMIC_ACQUIRE);
+        if (merged[slot].caller != 0) count++;
+    }
+    for (int core = 0; core < CORE_COUNT; core++) {
+        AllocProfileTable& table = tables.forCPU(core);
+        dropped += table.dropped;
+        for (int slot = 0; slot < ALLOC_PROFILE_SITES; slot++) {
+            AllocProfileStats& to = merged[slot].stats;
+            const AllocProfileStats& from = table.sites[slot];
+            to.allocs += from.allocs;
+            to.frees += from.frees;
+            to.alloc_bytes += from.alloc_bytes;
+            to.freed_bytes += from.freed_bytes;
+            to.window_allocs += from.window_allocs;
+        }
+    }
+
+    reportNow = get_ticks();
+    reportMinAge = min_age_us;
+    heap_walk(count_if_old);
+
+    uint64_t window_us = ticks_to_us(reportNow - windowStart);
+    if (window_us == 0) window_us = 1;
+    uint64_t total_live = 0;
+    uint64_t total_window = 0;
+    for (int slot = 0; slot < ALLOC_PROFILE_SITES; slot++) {
+        total_live += live_bytes(merged[slot]);
+        total_window += merged[slot].stats.window_allocs;
+    }
+
+    printf("heap allocation report, top %d of %d call sites\n", top_n, count);
+    printf("%d bytes live, %d allocations per second over the last %dms\n", total_live,
+           total_window * 1000000 / window_us, window_us / 1000);
+    for (int rank = 0; rank < top_n && rank < ALLOC_PROFILE_SITES; rank++) {
+        // selection sort, this is a debug path
+        int best = rank;
+        for (int j = rank + 1; j < ALLOC_PROFILE_SITES; j++) {
+            if (live_bytes(merged[j]) > live_bytes(merged[best])) {
+                best = j;
+            }
+        }
+        AllocProfileSite tmp = merged[rank];
+        merged[rank] = merged[best];
+        merged[best] = tmp;
+
+        AllocProfileSite& site = merged[rank];
+        if (site.caller == 0) break;
+        AllocProfileStats& s = site.stats;
+        printf("%d. caller 0x%x\n", rank + 1, (uint64_t)site.caller);
+        printf("    %d bytes live in %d objects, %d allocs, %d frees, %d per second\n",
+               live_bytes(site), s.allocs - s.frees, s.allocs, s.frees,
+               s.window_allocs * 1000000 / window_us);
+        if (site.old_objects != 0) {
+            printf("    %d objects (%d bytes) older than %dus\n", site.old_objects,
+                   site.old_bytes, min_age_us);
+        }
+    }
+    if (dropped != 0) {
+        printf("%d allocations untracked, the site table was full\n", dropped);
+    }
+}
+
+void alloc_profile_reset() {
+    for (int core = 0; core < CORE_COUNT; core++) {
+        bool was = Interrupts::disable();
+        AllocProfileTable& table = tables.forCPU(core);
+        for (int slot = 0; slot < ALLOC_PROFILE_SITES; slot++) {
+            table.sites[slot].window_allocs = 0;
+        }
+        Interrupts::restore(was);
+    }
+    windowStart = get_ticks();
+}
+
+#else
+
+void alloc_profile_report(int, uint64_t) {
+    printf("allocation profiling is not compiled in, build with ALLOC_PROFILE=1\n");
+}
+
+void alloc_profile_reset() {
+}
+
+#endif /* ALLOC_PROFILE */
@@ -4,29 +4,223 @@
 #include "printf.h"
 #include "queue.h"
 
+uint32_t semaphoreInlineDepth[CORE_COUNT] = {0};
+
+/**
+ * runs a granted continuation on this stack if the depth budget allows,
+ * otherwise queues it like before
+ */
+static void run_granted(Function<void()>& w) {
+    uint32_t& depth = semaphoreInlineDepth[getCoreID()];
+    if (depth >= SEMAPHORE_INLINE_DEPTH) {
+        create_event(w);
+        return;
+    }
+    depth++;
+    w();
+    depth--;
+}
+
+// lock free decrement, only succeeds while a unit is free
+bool Semaphore::try_take() {
+    int v = value.get(MemoryOrder::relaxed);
+    while (v > 0) {
+        // acquire pairs with the release in up()
+        if (value.compare_exchange_weak(v, v - 1, MemoryOrder::acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void Semaphore::up() {
-    LockGuard<SpinLock> guard(spin_lock);
-    value++;
-    if (value > 0 && blocked_queue.get_size() > 0) {
-        value--;
-        SemaphoreNode* node = blocked_queue.remove();
-        create_event(node->work);
-        delete node;
+    SemaphoreNode* node;
+    {
+        LockGuard<SpinLock> guard(spin_lock);
+        if (value.get(MemoryOrder::relaxed) < 0 || blocked_queue.get_size() == 0) {
+            value.add_fetch(1, MemoryOrder::release);
+            return;
+        }
+        // value is 0 while anyone waits, the unit goes straight to the waiter
+        node = blocked_queue.remove();
+#ifdef LOCK_PROFILE
+        granted_at = lock_profile_now();
+        lock_profile_acquired(this, true, granted_at - node->queued_at);
+#endif
     }
+    create_event(node->work);
+    delete node;
 }
 
 void Semaphore::down(Function<void()> w) {
-    LockGuard<SpinLock> guard(spin_lock);
-    if (value > 0) {
-        create_event(w);
-        value--;
-    } else {
-        SemaphoreNode* node = new SemaphoreNode(w);
-        blocked_queue.add(node);
+    if (!try_take()) {
+        LockGuard<SpinLock> guard(spin_lock);
+        // an up() may have landed between the CAS and taking the lock
+        if (!try_take()) {
+            SemaphoreNode* node = new SemaphoreNode(w);
+#ifdef LOCK_PROFILE
+            node->queued_at = lock_profile_now();
+#endif
+            blocked_queue.add(node);
+            return;
+        }
     }
+#ifdef LOCK_PROFILE
+    granted_at = lock_profile_now();
+    lock_profile_acquired(this, false, 0);
+#endif
+    // may free this semaphore, nothing below may touch it
+    run_granted(w);
+}
+
+bool Semaphore::try_down() {
+    if (!try_take()) {
+        return false;
+    }
+#ifdef LOCK_PROFILE
+    granted_at = lock_profile_now();
+    lock_profile_acquired(this, false, 0);
+#endif
+    return true;
 }
 
 void Semaphore::kill() {
     LockGuard<SpinLock> guard(spin_lock);
     blocked_queue.remove_if_and_free_node([](SemaphoreNode* node) { return true; });
-}
\ No newline at end of file
+}
+
+static bool rw_can_take(int s, bool exclusive) {
+    if (exclusive) {
+        return s == 0;
+    }
+    return (s & (RWLOCK_WRITER | RWLOCK_WAITING)) == 0;
+}
+
+bool RWLock::try_take(bool exclusive) {
+    int s = state.get(MemoryOrder::relaxed);
+    while (rw_can_take(s, exclusive)) {
+        int next = exclusive ? RWLOCK_WRITER : s + 1;
+        // acquire pairs with the release in unlock and hand_off
+        if (state.compare_exchange_weak(s, next, MemoryOrder::acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * caller holds spin_lock, either takes the lock or sets RWLOCK_WAITING so
+ * the releaser that drains it is sure to call hand_off
+ */
+bool RWLock::take_or_wait(bool exclusive) {
+    while (true) {
+        if (try_take(exclusive)) {
+            return true;
+        }
+        int s = state.get(MemoryOrder::relaxed);
+        if (rw_can_take(s, exclusive)) {
+            continue;
+        }
+        if (state.compare_exchange(s, s | RWLOCK_WAITING, MemoryOrder::relaxed)) {
+            return false;
+        }
+    }
+}
+
+void RWLock::acquire(Function<void()>& w, bool exclusive) {
+    if (!try_take(exclusive)) {
+        LockGuard<SpinLock> guard(spin_lock);
+        if (!take_or_wait(exclusive)) {
+            SemaphoreNode* node = new SemaphoreNode(w);
+#ifdef LOCK_PROFILE
+            node->queued_at = lock_profile_now();
+#endif
+            (exclusive ? writers : readers).add(node);
+            return;
+        }
+    }
+#ifdef LOCK_PROFILE
+    if (exclusive) {
+        granted_at = lock_profile_now();
+    }
+    lock_profile_acquired(this, false, 0);
+#endif
+    // may free this lock, nothing below may touch it
+    run_granted(w);
+}
+
+bool RWLock::try_lock_shared() {
+    if (!try_take(false)) {
+        return false;
+    }
+#ifdef LOCK_PROFILE
+    lock_profile_acquired(this, false, 0);
+#endif
+    return true;
+}
+
+bool RWLock::try_lock() {
+    if (!try_take(true)) {
+        return false;
+    }
+#ifdef LOCK_PROFILE
+    granted_at = lock_profile_now();
+    lock_profile_acquired(this, false, 0);
+#endif
+    return true;
+}
+
+void RWLock::unlock_shared() {
+    // only the last reader out sees exactly the flag
+    if (state.add_fetch(-1, MemoryOrder::acq_rel) == RWLOCK_WAITING) {
+        hand_off();
+    }
+}
+
+void RWLock::unlock() {
+#ifdef LOCK_PROFILE
+    lock_profile_released(this, lock_profile_now() - granted_at);
+#endif
+    int s = RWLOCK_WRITER;
+    if (!state.compare_exchange(s, 0, MemoryOrder::release)) {
+        state.set(RWLOCK_WAITING, MemoryOrder::release);
+        hand_off();
+    }
+}
+
+/**
+ * the lock is free but RWLOCK_WAITING is set, so no fast path can take it.
+ * Grants it to the oldest writer, or to every queued reader when no writer
+ * waits.
+ */
+void RWLock::hand_off() {
+    SemaphoreNode* granted;
+    {
+        LockGuard<SpinLock> guard(spin_lock);
+        if (writers.get_size() != 0) {
+            granted = writers.remove();
+            granted->next = nullptr;
+            bool more = writers.get_size() != 0 || readers.get_size() != 0;
+            state.set(RWLOCK_WRITER | (more ? RWLOCK_WAITING : 0), MemoryOrder::release);
+#ifdef LOCK_PROFILE
+            granted_at = lock_profile_now();
+#endif
+        } else {
+            int count = readers.get_size();
+            granted = readers.remove_all();
+            state.set(count, MemoryOrder::release);
+        }
+#ifdef LOCK_PROFILE
+        uint64_t now = lock_profile_now();
+        for (SemaphoreNode* it = granted; it != nullptr; it = it->next) {
+            lock_profile_acquired(this, true, now - it->queued_at);
+        }
+#endif
+    }
+    while (granted != nullptr) {
+        SemaphoreNode* next = granted->next;
+        create_event(granted->work);
+        delete granted;
+        granted = next;
+    }
+}
@@ -14,7 +14,24 @@
 #define MAP_FAILED (void *)-1
 #define ELF_RELOC_ERR -1
 
+/**
+ * libraries loaded so far, newest first. Nodes are never removed, so lookups
+ * walk it with acquire loads and no lock, loaded_libs_lock only serialises
+ * inserts.
+ */
 LoadedLibrary *g_loaded_libs = nullptr;
+static SpinLock loaded_libs_lock;
+
+static LoadedLibrary *find_loaded_library(const char *name) {
+    LoadedLibrary *lib = __atomic_load_n(&g_loaded_libs, __ATOMIC_ACQUIRE);
+    while (lib != nullptr) {
+        if (K::strcmp(lib->name, name) == 0) {
+            return lib;
+        }
+        lib = __atomic_load_n(&lib->next, __ATOMIC_ACQUIRE);
+    }
+    return nullptr;
+}
 
 bool elf_check_file(Elf64_Ehdr *hdr) {
     if (!hdr) return false;
@@ -557,10 +574,9 @@ static inline void *elf_load_rel(Elf64_Ehdr *hdr, PCB *pcb, Semaphore *sema) {
 
 void *load_library(char *name, PCB *pcb, Semaphore *sema) {
     // check if already loaded
-    for (LoadedLibrary *lib = g_loaded_libs; lib; lib = lib->next) {
-        if (K::strcmp(lib->name, name) == 0) {
-            return lib->ehdr;
-        }
+    LoadedLibrary *loaded = find_loaded_library(name);
+    if (loaded != nullptr) {
+        return loaded->ehdr;
     }
 
     // load
@@ -583,12 +599,23 @@ void *load_library(char *name, PCB *pcb, Semaphore *sema) {
         return nullptr;
     }
 
-    // add to global list
+    // add to global list, unless another loader got there first
     LoadedLibrary *new_lib = (LoadedLibrary *)kmalloc(sizeof(LoadedLibrary));
     new_lib->ehdr = lib_hdr;
     new_lib->name = name;
-    new_lib->next = g_loaded_libs;
-    g_loaded_libs = new_lib;
+    loaded_libs_lock.lock();
+    loaded = find_loaded_library(name);
+    if (loaded == nullptr) {
+        new_lib->next = g_loaded_libs;
+        // release, a lookup that finds new_lib sees it filled in
+        __atomic_store_n(&g_loaded_libs, new_lib, __ATOMIC_RELEASE);
+    }
+    loaded_libs_lock.unlock();
+    if (loaded != nullptr) {
+        kfree(new_lib);
+        kfree(buffer);
+        return loaded->ehdr;
+    }
 
     // relocate by stage
     elf_load_stage1(lib_hdr, pcb);
@@ -0,0 +1,96 @@
+#include "epoch.h"
+
+#include "atomic.h"
+#include "event.h"
+#include "percpu.h"
+
+struct EpochCore {
+    Atomic<uint64_t> epoch;  // seen at the last quiescent point, EPOCH_IDLE while asleep
+    EpochRetired* retired;   // only touched by the owning core
+    uint32_t pending;
+
+    EpochCore() : epoch(0), retired(nullptr), pending(0) {
+    }
+} __attribute__((aligned(64)));  // epoch is written every event, keep cores off each other's line
+
+static PerCPU<EpochCore> epochCores;
+static Atomic<uint64_t> globalEpoch(0);
+
+void epoch_retire_raw(void* ptr, void (*free)(void*)) {
+    EpochRetired* node = new EpochRetired;
+    node->ptr = ptr;
+    node->free = free;
+    // seq_cst, ordered after the unlink that made ptr unreachable
+    node->epoch = globalEpoch.add_fetch(1);
+
+    EpochCore& me = epochCores.mine();
+    node->next = me.retired;
+    me.retired = node;
+    me.pending++;
+}
+
+// the oldest epoch any core may still be reading under
+static uint64_t safe_epoch() {
+    uint64_t safe = EPOCH_IDLE;
+    for (int core = 0; core < CORE_COUNT; core++) {
+        uint64_t seen = epochCores.forCPU(core).epoch.get(MemoryOrder::acquire);
+        if (seen < safe) safe = seen;
+    }
+    return safe;
+}
+
+static void reclaim(EpochCore& me) {
+    // pairs with the fence a waking core issues after publishing its epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t safe = safe_epoch();
+
+    EpochRetired** link = &me.retired;
+    while (*link != nullptr) {
+        EpochRetired* node = *link;
+        if (node->epoch <= safe) {
+            *link = node->next;
+            node->free(node->ptr);
+            delete node;
+            me.pending--;
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+static void publish(EpochCore& me) {
+    // acquire pairs with retire's bump, so an epoch at least as new as a tag
+    // also means the unlink behind it is visible here
+    uint64_t now = globalEpoch.get(MemoryOrder::acquire);
+    if (me.epoch.get(MemoryOrder::relaxed) != now) {
+        me.epoch.set(now);
+        // a core coming out of idle must be seen before it reads anything, or
+        // a reclaimer that still sees EPOCH_IDLE could free under it
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void epoch_quiescent(int core) {
+    EpochCore& me = epochCores.forCPU(core);
+    publish(me);
+    if (me.retired != nullptr) {
+        reclaim(me);
+    }
+}
+
+void epoch_enter(int core) {
+    EpochCore& me = epochCores.forCPU(core);
+    // an event in the middle of a read keeps its older epoch, only a core
+    // coming back from user space publishes here
+    if (me.epoch.get(MemoryOrder::relaxed) == EPOCH_IDLE) {
+        publish(me);
+    }
+}
+
+void epoch_idle(int core) {
+    epochCores.forCPU(core).epoch.set(EPOCH_IDLE, MemoryOrder::release);
+}
+
+uint32_t epoch_pending(int core) {
+    return epochCores.forCPU(core).pending;
+}
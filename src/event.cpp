@@ -2,6 +2,8 @@
 #include "event.h"
 
 #include "atomic.h"
+#include "epoch.h"
+#include "irq.h"
 #include "libk.h"
 #include "percpu.h"
 #include "peripherals/arm_devices.h"
@@ -9,6 +11,7 @@
 #include "queue.h"
 #include "stdint.h"
 #include "sys.h"
+#include "timer.h"
 #include "utils.h"
 
 extern "C" void load_user_context(cpu_context* context);
@@ -30,87 +33,327 @@ UserTCB* runningUserTCB[CORE_COUNT] = {nullptr};
 // use an array for multiple cores, index with getCoreId
 TCB* runningEvent[CORE_COUNT] = {nullptr};
 
+// stands in as the running event while a core is idle so irqs never see a freed TCB
+TCB* idleEvent[CORE_COUNT] = {nullptr};
+
+Atomic<uint32_t> idleCores(0);
+
+// set while a core runs a user thread with its preemption timer off, cleared
+// once the core is back in run_events
+volatile bool skippedTick[CORE_COUNT] = {false};
+
+// time spent parked in wfi, in generic timer ticks
+uint64_t idleTicks[CORE_COUNT] = {0};
+uint64_t bootTicks = 0;
+
+uint64_t remotePosts[CORE_COUNT] = {0};
+uint64_t migratedEvents[CORE_COUNT] = {0};
+
 void init_dummy_tcb() {
+    bootTicks = get_ticks();
     for (int i = 0; i < CORE_COUNT; ++i) {
         runningEvent[i] = new Event([] { printf("SHOULD NOT PRINT\n"); });
+        idleEvent[i] = runningEvent[i];
+    }
+}
+
+/**
+ * frees a killed thread, its process then exits like it called exit. That
+ * runs as an event of its own rather than inside the scheduler.
+ */
+static void drop_killed(TCB* tcb) {
+    PCB* pcb = tcb->kernel_event ? nullptr : ((UserTCB*)tcb)->pcb;
+    delete tcb;
+    if (pcb != nullptr) {
+        create_event([pcb] { exit_process(pcb, -1); });
+    }
+}
+
+/**
+ * pops the first runnable TCB at one priority level. Killed TCBs and threads
+ * with a pending SIGKILL are freed and threads with a pending SIGSTOP are
+ * parked on their process's wait queue, so nothing that cannot run is ever
+ * pushed back onto a ready queue. Signals cost one load of the pending mask.
+ */
+TCB* pop_level(CPU_Queues& ready, int i) {
+    TCB* next = nullptr;
+    while (next = ready.queues[i].pop()) {
+        if (next->state == TASK_KILLED) {
+            drop_killed(next);
+            continue;
+        }
+        K::assert(next->state == TASK_RUNNING, "blocked TCB on a ready queue\n");
+        if (!next->kernel_event) {
+            PCB* pcb = ((UserTCB*)next)->pcb;
+            if (pcb != nullptr && pcb->signal_pending(SIGKILL)) {
+                drop_killed(next);
+                continue;
+            }
+            if (pcb != nullptr && pcb->stop_requested &&
+                pcb->stopped.sleep_if((UserTCB*)next, pcb->stop_requested)) {
+                continue;
+            }
+        }
+        return next;
     }
+    return nullptr;
 }
 
+/**
+ * moves everything other cores and irq handlers posted into this core's ready
+ * queues, called by the owner with interrupts off
+ */
+void drain_inbox(CPU_Queues& ready) {
+    TCB* it = ready.inbox.take_all();
+    while (it != nullptr) {
+        TCB* next = it->next;
+        ready.queues[it->post_priority].push(it);
+        it = next;
+    }
+}
+
+// how many times each core has picked an event, drives mlfq aging
+uint32_t schedulerPicks[CORE_COUNT] = {0};
+
+/**
+ * Kernel bands always go first. User bands are served from the top, except
+ * every MLFQ_AGING_INTERVAL picks where the bottom band goes first so a cpu
+ * hog can never be starved by interactive threads.
+ */
 TCB* getNextEvent(int core) {
     auto& ready = readyQueue.forCPU(core);
+    TCB* next = nullptr;
+    drain_inbox(ready);
+    for (int i = KERNEL_PRIORITY_HIGH; i < USER_PRIORITY_HIGH; i++) {
+        if (next = pop_level(ready, i)) return next;
+    }
+
+    if (++schedulerPicks[core] % MLFQ_AGING_INTERVAL == 0) {
+        for (int i = USER_PRIORITY_LOW; i >= USER_PRIORITY_HIGH; i--) {
+            if (next = pop_level(ready, i)) return next;
+        }
+        return nullptr;
+    }
+
+    for (int i = USER_PRIORITY_HIGH; i <= USER_PRIORITY_LOW; i++) {
+        if (next = pop_level(ready, i)) return next;
+    }
+    return nullptr;
+}
+
+int mlfq_wakeup(UserTCB* tcb) {
+    PCB* pcb = tcb->pcb;
+    if (pcb == nullptr) return USER_PRIORITY_DEFAULT;
+    if (pcb->priority > USER_PRIORITY_HIGH) pcb->priority--;
+    return pcb->effective_priority();
+}
+
+int mlfq_preempted(UserTCB* tcb) {
+    PCB* pcb = tcb->pcb;
+    if (pcb == nullptr) return USER_PRIORITY_DEFAULT;
+    if (pcb->priority < USER_PRIORITY_LOW) pcb->priority++;
+    return pcb->effective_priority();
+}
+
+/**
+ * Walks the other cores starting with our neighbour and steals half of the
+ * highest priority work we find into our own queues. Returns true if anything
+ * was moved.
+ */
+bool steal_work(int me) {
+    auto& mine = readyQueue.forCPU(me);
     for (int i = 0; i < PRIORITY_LEVELS; i++) {
-        TCB* next = nullptr;
-        while (next = ready.queues[i].remove()) {
-            if (next->state == TASK_RUNNING)
-                return next;
-            else if (next->state == TASK_STOPPED) {
-                ready.queues[4].add(next);
-            } else if (next->state == TASK_KILLED) {
-                delete next;
+        for (int victim = (me + 1) % CORE_COUNT; victim != me; victim = (victim + 1) % CORE_COUNT) {
+            auto& theirs = readyQueue.forCPU(victim).queues[i];
+            if (theirs.empty()) {
                 continue;
             }
-
-            bool terminated = false;
-            if (!next->kernel_event) {
-                // check if any signals came that killed the process
-                Signal* sig;
-                Queue<Signal> leftover;
-                while (sig = ((UserTCB*)next)->pcb->sigs->remove()) {
-                    if (sig->val == SIGKILL) {
-                        terminated = true;
-                        break;
-                    } else {
-                        leftover.add(sig);
-                    }
-                }
-                sig = leftover.remove();
-                while (sig != nullptr && !terminated) {
-                    ((UserTCB*)next)->pcb->sigs->add(sig);
-                    sig = leftover.remove();
-                }
+            if (mine.queues[i].steal_from(theirs) > 0) {
+                return true;
             }
-            if (terminated) {
-                delete next;
-                continue;
+        }
+    }
+    return false;
+}
+
+/**
+ * racy check across every core's queues, only used to avoid sleeping when a
+ * wakeup could have been missed
+ */
+bool work_available() {
+    for (int core = 0; core < CORE_COUNT; core++) {
+        if (!readyQueue.forCPU(core).inbox.empty()) {
+            return true;
+        }
+        for (int i = 0; i < PRIORITY_LEVELS; i++) {
+            if (!readyQueue.forCPU(core).queues[i].empty()) {
+                return true;
             }
         }
     }
-    return nullptr;
+    return false;
+}
+
+/**
+ * Parks the core in wfi until another core rings our mailbox or an interrupt
+ * arrives. Must be called with interrupts disabled, wfi still wakes on a
+ * masked interrupt so we briefly enable them afterwards to let it run.
+ */
+void idle(int me) {
+    uint32_t bit = 1 << me;
+    runningEvent[me] = idleEvent[me];
+    epoch_idle(me);
+
+    // publish that we are asleep before the last look, a core that queues work
+    // after this point is guaranteed to see the bit and send an ipi. Both
+    // sides store then load, so each needs a full barrier in between or the
+    // stlxr in fetch_or can pass the loads and both miss each other
+    idleCores.fetch_or(bit);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!work_available()) {
+        uint64_t start = get_ticks();
+        asm volatile("dsb sy\n\twfi" ::: "memory");
+        idleTicks[me] += get_ticks() - start;
+    }
+    idleCores.fetch_and(~bit);
+    clear_ipi(me);
+
+    enable_irq();
+    disable_irq();
+}
+
+/**
+ * wakes one sleeping core so it can steal the work we just queued
+ */
+void wake_idle_core() {
+    uint32_t idle = idleCores.get();
+    int me = getCoreID();
+    for (int core = 0; core < CORE_COUNT; core++) {
+        uint32_t bit = 1 << core;
+        if (core == me || (idle & bit) == 0) {
+            continue;
+        }
+        // only the core that clears the bit sends the ipi
+        if (idleCores.fetch_and(~bit) & bit) {
+            send_ipi(core);
+            return;
+        }
+    }
+}
+
+void wake_core(int core) {
+    uint32_t bit = 1 << core;
+    // pairs with the fence in idle, the post must be visible before we look
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((idleCores.get() & bit) && (idleCores.fetch_and(~bit) & bit)) {
+        send_ipi(core);
+    } else if (skippedTick[core]) {
+        // running a user thread with no timer, the ipi makes it start a quantum
+        send_ipi(core);
+    }
+}
+
+bool local_work_pending(int core) {
+    auto& ready = readyQueue.forCPU(core);
+    if (!ready.inbox.empty()) {
+        return true;
+    }
+    for (int i = 0; i < PRIORITY_LEVELS; i++) {
+        if (!ready.queues[i].empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * called right before dropping into user space. If nothing else is queued
+ * on this core the thread would only be preempted to be picked straight
+ * back up, so the tick is skipped and the timer left off.
+ */
+void start_preempt_timer(int me) {
+    if (local_work_pending(me)) {
+        skippedTick[me] = false;
+        arm_preempt_timer();
+    } else {
+        skippedTick[me] = true;
+        disarm_preempt_timer();
+    }
+}
+
+/**
+ * called at the end of every irq, starts the quantum a core skipped as soon
+ * as something else wants to run there
+ */
+void check_preempt_timer(int me) {
+    if (skippedTick[me] && local_work_pending(me)) {
+        skippedTick[me] = false;
+        arm_preempt_timer();
+    }
+}
+
+/**
+ * microseconds core has spent asleep since the scheduler started
+ */
+uint64_t get_idle_time(int core) {
+    return ticks_to_us(idleTicks[core]);
+}
+
+void print_idle_stats() {
+    uint64_t total = get_ticks() - bootTicks;
+    if (total == 0) return;
+    for (int core = 0; core < CORE_COUNT; core++) {
+        uint64_t busy_pct = 100 - (idleTicks[core] * 100) / total;
+        printf("core %d: idle %dus, utilisation %d%%\n", core, get_idle_time(core), busy_pct);
+    }
+}
+
+void print_affinity_stats() {
+    for (int core = 0; core < CORE_COUNT; core++) {
+        printf("core %d: %d remote posts, %d migrated events\n", core, remotePosts[core],
+               migratedEvents[core]);
+    }
 }
 
 /**
  * This function is the main event loop. It runs in a loop, checking for events
- * to run. If there are no events, it will check the next core for events.
- * If there are still no events, it will continue to spin.
+ * to run. If there are no events, it will steal a batch of events from another
+ * core. If there are still no events, the core sleeps until it is woken.
  */
 void run_events() {
     TCB* nextThread;
     int me = getCoreID();
+    // whatever user thread ran here is gone, wake_core has no tick to restart
+    skippedTick[me] = false;
 
     while (true) {
         bool was = Interrupts::disable();
+        // nothing from the last event is still held, let retired nodes go
+        epoch_quiescent(me);
         nextThread = getNextEvent(me);
 
-        if (nextThread == nullptr) {
-            int nextCore = (me + 1) % CORE_COUNT;
-            while (nextCore != me && nextThread == nullptr) {
-                nextThread = getNextEvent(nextCore);
-                nextCore = (nextCore + 1) % CORE_COUNT;  // Move to the next core
-            }
+        if (nextThread == nullptr && steal_work(me)) {
+            nextThread = getNextEvent(me);
+        }
 
-            if (nextThread == nullptr)  // no other threads. I can keep working/spinning
-            {
-                continue;
-                enable_irq();
-            }
+        if (nextThread == nullptr)  // no other threads. sleep until someone queues work
+        {
+            idle(me);
+            continue;
+        }
+        if (nextThread->home_core >= 0 && nextThread->home_core != me) {
+            migratedEvents[me]++;
         }
         runningEvent[getCoreID()] = nextThread;
+        semaphoreInlineDepth[me] = 0;  // whatever ran inline before has been unwound
         nextThread->run();
         if (!nextThread->kernel_event) {
             K::assert(false, "user event returned to event loop");
         }
 
-        delete nextThread; /* only kernel events so UserTCB's shouldn't be deleted*/
+        if (!nextThread->persistent) {
+            delete nextThread; /* only kernel events so UserTCB's shouldn't be deleted*/
+        }
     }
 }
 
@@ -132,6 +375,10 @@ void enter_user_space(UserTCB* tcb) {
     flush_tlb();
     runningUserTCB[getCoreID()] = tcb;
     runningEvent[getCoreID()] = tcb;
+    tcb->home_core = getCoreID();
+    start_preempt_timer(getCoreID());
+    // nothing read in the kernel is held past this point
+    epoch_idle(getCoreID());
     // it is now safe to preempt
     load_user_context(&tcb->context);
 }
@@ -195,20 +442,8 @@ void yield(KernelEntryFrame* frame) {
     K::assert((running == old), "mismatched running event and user thread\n");
     //  printf("preempt!\n");
     save_user_context(old, frame);
-    readyQueue.forCPU(getCoreID()).queues[1].add(old);
-    QA7->TimerClearReload.IntClear = 1;  // Clear interrupt
-    // route to next core
-    auto me = getCoreID();
-    if (me == 0) {
-        QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE1_IRQ;
-    } else if (me == 1) {
-        QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE2_IRQ;
-    } else if (me == 2) {
-        QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE3_IRQ;
-    } else {
-        QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE0_IRQ;
-    }
-    QA7->TimerClearReload.Reload = 1;  // Reload
+    // used its whole quantum, drop it a level
+    readyQueue.forCPU(getCoreID()).queues[mlfq_preempted(old)].push(old);
     enable_irq();
     event_loop();
 }
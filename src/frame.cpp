@@ -2,17 +2,112 @@
 
 #include "atomic.h"
 #include "event.h"
+#include "heap.h"
+#include "percpu.h"
 #include "printf.h"
 #include "stdint.h"
 #include "vm.h"
 
-int index = 0;
 int num_frames = 0;
 Frame* frame_table = 0;
-SpinLock lock;  // switch to blocking lock
+SpinLock lock;  // the buddy lists, and pin counts of frames shared between owners
+
+// buddy free lists, linked through the frame table entry of each block's first frame
+static int free_heads[FRAME_ORDERS];
+static uint32_t free_counts[FRAME_ORDERS];
+
+/**
+ * order-0 frames a core keeps for itself, so allocating and freeing single
+ * frames only takes the lock once per FRAME_CACHE_BATCH of them
+ */
+struct __attribute__((aligned(64))) FrameCache {
+    int frames[FRAME_CACHE_MAX];
+    int count = 0;
+};
+
+static PerCPU<FrameCache> frameCaches;
+
+static void push_block(int i, int order) {
+    Frame& f = frame_table[i];
+    f.flags = FREE_BLOCK_FLAG;
+    f.order = order;
+    f.buddy_prev = -1;
+    f.buddy_next = free_heads[order];
+    if (free_heads[order] != -1) {
+        frame_table[free_heads[order]].buddy_prev = i;
+    }
+    free_heads[order] = i;
+    free_counts[order]++;
+}
+
+static void unlink_block(int i) {
+    Frame& f = frame_table[i];
+    if (f.buddy_prev != -1) {
+        frame_table[f.buddy_prev].buddy_next = f.buddy_next;
+    } else {
+        free_heads[f.order] = f.buddy_next;
+    }
+    if (f.buddy_next != -1) {
+        frame_table[f.buddy_next].buddy_prev = f.buddy_prev;
+    }
+    free_counts[f.order]--;
+    f.flags = 0;
+}
+
+/**
+ * puts a block back, merging it with its buddy for as long as the buddy is a
+ * free block of the same order
+ */
+static void free_block(int i, int order) {
+    while (order < FRAME_MAX_ORDER) {
+        int buddy = i ^ (1 << order);
+        if (buddy + (1 << order) > num_frames) break;
+        Frame& b = frame_table[buddy];
+        if (!(b.flags & FREE_BLOCK_FLAG) || b.order != order) break;
+        unlink_block(buddy);
+        i &= ~(1 << order);
+        order++;
+    }
+    push_block(i, order);
+}
+
+/**
+ * takes a block of 2^order frames from the smallest order that has one,
+ * splitting off the upper halves on the way down. -1 if there is none
+ */
+static int alloc_block(int order) {
+    int from = order;
+    while (from < FRAME_ORDERS && free_heads[from] == -1) {
+        from++;
+    }
+    if (from == FRAME_ORDERS) {
+        return -1;
+    }
+    int i = free_heads[from];
+    unlink_block(i);
+    while (from > order) {
+        from--;
+        push_block(i + (1 << from), from);
+    }
+    return i;
+}
+
+// frees [start, end) as the largest aligned blocks that fit
+static void free_range(int start, int end) {
+    while (start < end) {
+        int order = 0;
+        while (order < FRAME_MAX_ORDER && (start & ((2 << order) - 1)) == 0 &&
+               start + (2 << order) <= end) {
+            order++;
+        }
+        free_block(start, order);
+        start += 1 << order;
+    }
+}
 
 void create_frame_table(uintptr_t start, int size) {
     frame_table = (Frame*)start;
+    lock_profile_name(&lock, "frame table");
     num_frames = size / PAGE_SIZE;
     for (int i = 0; i < num_frames; i++) {
         frame_table[i].flags = 0;
@@ -34,34 +129,80 @@ void create_frame_table(uintptr_t start, int size) {
         frame_table[i].flags |= PINNED_PAGE_FLAG;
         frame_table[i].pin_count = 1;
     }
+
+    for (int order = 0; order < FRAME_ORDERS; order++) {
+        free_heads[order] = -1;
+        free_counts[order] = 0;
+    }
+    // every run of frames left free goes on the buddy lists
+    for (int i = 0; i < num_frames;) {
+        if (frame_table[i].flags & USED_PAGE_FLAG) {
+            i++;
+            continue;
+        }
+        int run_end = i;
+        while (run_end < num_frames && !(frame_table[run_end].flags & USED_PAGE_FLAG)) {
+            run_end++;
+        }
+        free_range(i, run_end);
+        i = run_end;
+    }
 }
-int get_free_index_unlocked() {
-    for (int i = 0; i < num_frames; i++) {
-        if (!(frame_table[index].flags & USED_PAGE_FLAG)) {
-            int temp = index;
-            index += 1;
-            index %= num_frames;
-            return temp;
+
+static int take_frame() {
+    bool was = Interrupts::disable();
+    FrameCache& cache = frameCaches.mine();
+    if (cache.count == 0) {
+        LockGuard<SpinLock> guard(lock);
+        while (cache.count < FRAME_CACHE_BATCH) {
+            int i = alloc_block(0);
+            if (i == -1) break;
+            cache.frames[cache.count++] = i;
         }
-        index += 1;
-        index %= num_frames;
     }
-    // no free frames
-    return -1;
+    int index = cache.count == 0 ? -1 : cache.frames[--cache.count];
+    Interrupts::restore(was);
+    return index;
+}
+
+static void give_frame(int index) {
+    bool was = Interrupts::disable();
+    FrameCache& cache = frameCaches.mine();
+    cache.frames[cache.count++] = index;
+    if (cache.count == FRAME_CACHE_MAX) {
+        LockGuard<SpinLock> guard(lock);
+        while (cache.count > FRAME_CACHE_MAX - FRAME_CACHE_BATCH) {
+            free_block(cache.frames[--cache.count], 0);
+        }
+    }
+    Interrupts::restore(was);
+}
+
+/**
+ * a frame nobody else can see yet, so its entry is written without the lock
+ */
+static int claim_frame(int flags, PageLocation* location) {
+    int index = take_frame();
+    // out of frames, take back whatever heap chunks sit idle before evicting.
+    // No lock is held here, heap_trim takes the heap lock first.
+    if (index == -1 && heap_trim() != 0) {
+        index = take_frame();
+    }
+    if (index == -1) {
+        return -1;
+    }
+    frame_table[index].flags = flags | USED_PAGE_FLAG;
+    frame_table[index].pin_count = (flags & PINNED_PAGE_FLAG) ? 1 : 0;
+    frame_table[index].contents = location;
+    return index;
 }
 
 /**
  * allocates a frame from physical memory
  */
 void alloc_frame(int flags, Function<void(uint64_t)> w) {
-    LockGuard<SpinLock>{lock};
-    int index = get_free_index_unlocked();
+    int index = claim_frame(flags, nullptr);
     if (index != -1) {
-        frame_table[index].flags = flags;
-
-        if (frame_table[index].flags & PINNED_PAGE_FLAG) frame_table[index].pin_count = 1;
-
-        frame_table[index].flags |= USED_PAGE_FLAG;
         create_event<uint64_t>(w, index * PAGE_SIZE, 1);
     } else {
         // evict
@@ -72,30 +213,99 @@ void alloc_frame(int flags, Function<void(uint64_t)> w) {
  * allocates a frame from physical memory + maps location struct
  */
 void alloc_frame(int flags, PageLocation* location, Function<void(uint64_t)> w) {
-    LockGuard<SpinLock>{lock};
-    int index = get_free_index_unlocked();
+    int index = claim_frame(flags, location);
     if (index != -1) {
-        frame_table[index].flags = flags;
-        frame_table[index].flags |= USED_PAGE_FLAG;
-        frame_table[index].contents = location;
         create_event<uint64_t>(w, index * PAGE_SIZE, 1);
     } else {
         // evict
     }
 }
 
+Future<uint64_t> alloc_frame_async(int flags, PageLocation* location) {
+    int index = claim_frame(flags, location);
+    if (index == -1) {
+        // evict, until then the future never completes just like alloc_frame
+        return Promise<uint64_t>().get_future();
+    }
+    return make_ready_future((uint64_t)index * PAGE_SIZE);
+}
+
+/**
+ * claims count free frames in a row, pinned so they are never evicted. Comes
+ * from the smallest buddy block that fits, the frames past count go straight
+ * back.
+ */
+uint64_t alloc_frame_run(int count) {
+    int order = 0;
+    while ((1 << order) < count) {
+        order++;
+    }
+    if (order > FRAME_MAX_ORDER) {
+        return 0;
+    }
+    LockGuard<SpinLock> guard(lock);
+    int start = alloc_block(order);
+    if (start == -1) {
+        return 0;
+    }
+    free_range(start + count, start + (1 << order));
+    for (int i = start; i < start + count; i++) {
+        frame_table[i].flags = USED_PAGE_FLAG | PINNED_PAGE_FLAG;
+        frame_table[i].pin_count = 1;
+        frame_table[i].contents = nullptr;
+    }
+    return (uint64_t)start * PAGE_SIZE;
+}
+
+void free_frame_run(uintptr_t frame_addr, int count) {
+    int first = frame_addr / PAGE_SIZE;
+    if (first < 0 || first + count > num_frames) {
+        return;
+    }
+    LockGuard<SpinLock> guard(lock);
+    for (int i = first; i < first + count; i++) {
+        frame_table[i].flags = 0;
+        frame_table[i].pin_count = 0;
+        frame_table[i].contents = nullptr;
+    }
+    free_range(first, first + count);
+}
+
+uint64_t free_frame_count() {
+    uint64_t count = 0;
+    {
+        LockGuard<SpinLock> guard(lock);
+        for (int order = 0; order < FRAME_ORDERS; order++) {
+            count += (uint64_t)free_counts[order] << order;
+        }
+    }
+    // racy for the other cores' caches, they only ever hold a few frames
+    for (int core = 0; core < CORE_COUNT; core++) {
+        count += frameCaches.forCPU(core).count;
+    }
+    return count;
+}
+
 bool free_frame(uintptr_t frame_addr) {
-    LockGuard<SpinLock>{lock};
     int index = frame_addr / PAGE_SIZE;
-    if (index >= 0 && index < num_frames && !(frame_table[index].flags & PINNED_PAGE_FLAG)) {
-        frame_table[index].flags &= ~USED_PAGE_FLAG;
-        return true;
+    if (index < 0 || index >= num_frames) {
+        return false;
+    }
+    {
+        LockGuard<SpinLock> guard(lock);
+        Frame& f = frame_table[index];
+        if ((f.flags & PINNED_PAGE_FLAG) || !(f.flags & USED_PAGE_FLAG)) {
+            return false;
+        }
+        f.flags = 0;
+        f.contents = nullptr;
     }
-    return false;
+    give_frame(index);
+    return true;
 }
 
 void pin_frame(uintptr_t frame_addr) {
-    LockGuard<SpinLock>{lock};
+    LockGuard<SpinLock> guard(lock);
     int index = frame_addr / PAGE_SIZE;
     if (index >= 0 && index < num_frames) {
         frame_table[index].flags |= PINNED_PAGE_FLAG;
@@ -104,7 +314,7 @@ void pin_frame(uintptr_t frame_addr) {
 }
 
 void unpin_frame(uintptr_t frame_addr) {
-    LockGuard<SpinLock>{lock};
+    LockGuard<SpinLock> guard(lock);
     int index = frame_addr / PAGE_SIZE;
     if (index >= 0 && index < num_frames) {
         if (frame_table[index].pin_count >= 1) frame_table[index].pin_count -= 1;
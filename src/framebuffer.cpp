@@ -332,6 +332,7 @@ const unsigned int smiley_face[16 * 16] = {
 // =======================
 
 #define MAX_CORES 4
+#define ANIMATION_FRAME_US 16000 /* roughly 60 frames a second */
 
 struct AnimationState {
     int x;
@@ -427,10 +428,7 @@ void update_animation(void) {
         }
     }
 
-    for (volatile int i = 0; i < 1000000; i++) {
-        asm volatile("nop");
-    }
-    create_event(update_animation);
+    create_event_after(ANIMATION_FRAME_US, update_animation);
 }
 
 void clear_screen(void) {
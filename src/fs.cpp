@@ -4,6 +4,7 @@
 
 #include "../filesystem/filesys/fs_requests.h"
 #include "atomic.h"
+#include "epoch.h"
 #include "event.h"
 #include "filesys_compat/vector"
 #include "hash.h"
@@ -12,8 +13,13 @@
 #include "ramfs.h"
 #include "utils.h"
 
-static Queue<FileListNode> open_files;
-Lock* file_list_lock = nullptr;
+/**
+ * kopen's cache of open files, newest first. Lookups walk it without a lock,
+ * changes are serialised by open_files_lock and unlinked nodes and files go
+ * through epoch_retire.
+ */
+static FileListNode* open_files = nullptr;
+static SpinLock open_files_lock;
 
 volatile uint64_t inode_numbers = 0;
 SpinLock inode_number_lock;
@@ -21,14 +27,53 @@ SpinLock inode_number_lock;
 constexpr char* RAMFS_PREFIX = "/dev/ramfs/";
 constexpr int RAMFS_PREFIX_LEN = K::strlen(RAMFS_PREFIX);
 
-void init_file_list_lock() {
-    if (file_list_lock == nullptr) {
-        inode_number_lock.lock();
-        if (file_list_lock == nullptr) {
-            file_list_lock = new Lock;
+/**
+ * an open file with this name with a reference taken for the caller, or
+ * nullptr. A file whose last reference is already gone is skipped, it is on
+ * its way out of the list.
+ */
+static KFile* find_open_file(uint64_t name_hash) {
+    FileListNode* n = __atomic_load_n(&open_files, __ATOMIC_ACQUIRE);
+    while (n != nullptr) {
+        if (n->name_hash == name_hash && n->file->try_increment_ref_count()) {
+            return n->file;
+        }
+        n = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+    }
+    return nullptr;
+}
+
+static void add_open_file(KFile* file, uint64_t name_hash) {
+    FileListNode* node = new FileListNode(file, name_hash);
+    LockGuard<SpinLock> guard(open_files_lock);
+    node->next = open_files;
+    // release, a lookup that finds node sees it filled in
+    __atomic_store_n(&open_files, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * the last reference to file is gone, take it out of the cache. Lookups may
+ * still be looking at it, so it and its node are only freed after a grace
+ * period.
+ */
+void kfile_unreferenced(KFile* file) {
+    FileListNode* node = nullptr;
+    {
+        LockGuard<SpinLock> guard(open_files_lock);
+        FileListNode** link = &open_files;
+        while (*link != nullptr) {
+            if ((*link)->file == file) {
+                node = *link;
+                __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+                break;
+            }
+            link = &(*link)->next;
         }
-        inode_number_lock.unlock();
     }
+    if (node != nullptr) {
+        epoch_retire(node);
+    }
+    epoch_retire(file);
 }
 
 string clean_path_string(string& file_path) {
@@ -72,8 +117,6 @@ string clean_path_string(string& file_path) {
  * This as of right now does not verify the file exists, only checks if
  */
 void kopen(string file_name, Function<void(KFile*)> w) {
-    init_file_list_lock();
-
     // Minify the path.
     string cleaned_file_name = clean_path_string(file_name);
 
@@ -81,62 +124,44 @@ void kopen(string file_name, Function<void(KFile*)> w) {
     auto name_hash = cleaned_file_name.hash();
 
     /* TODO: verify file exists and get characteristics */
-    file_list_lock->lockAndRelease([=]() {
-        KFile* file = nullptr;
-        open_files.remove_if_and_free_node([&](FileListNode* n) {
-            // KFile has been deleted, remove it / no refs.
-            if (!n->file || n->file->get_ref_count() == 0) {
-                return true;
-            }
+    KFile* file = find_open_file(name_hash);
+
+    // We found the inode in the list, already referenced for us.
+    if (file != nullptr) {
+        create_event<KFile*>(w, file);
+        return;
+    }
 
-            // Hash mismatch, remove it.
-            if (n->name_hash != name_hash) {
-                return true;
+    // Get inode number from file system or device.
+    if (!cleaned_file_name.starts_with("/dev/")) {
+        // Callback issued once we get a response from the filesystem.
+        auto callback = [=](fs::fs_response_t resp) mutable {
+            // want better error handling here.
+            if (resp.data.open.status == fs::FS_RESP_ERROR_NOT_FOUND) {
+                printf("fs says file %s not found\n", cleaned_file_name.c_str());
+                create_event<KFile*>(w, nullptr);
+                return;
             }
 
-            // If open and has refs, save the reference.
-            file = n->file;
-            return false;
-        });
+            // Create file and add to file list node.
+            // Ref count is 1 by default.
+            file = new FSFile(resp.data.open.inode_index, resp.data.open.permissions);
+            printf("kopen: getting inode number\n");
+            printf("kopen: core %d: File Inode Index = %d\n", getCoreID(),
+                   file->get_inode_number());
+            add_open_file(file, name_hash);
 
-        // We found the inode in the list.
-        if (file != nullptr) {
-            file->increment_ref_count_atomic();
+            // Create event.
             create_event<KFile*>(w, file);
-            return;
-        }
-
-        // Get inode number from file system or device.
-        if (!cleaned_file_name.starts_with("/dev/")) {
-            // Callback issued once we get a response from the filesystem.
-            auto callback = [=](fs::fs_response_t resp) mutable {
-                // want better error handling here.
-                if (resp.data.open.status == fs::FS_RESP_ERROR_NOT_FOUND) {
-                    printf("fs says file %s not found\n", cleaned_file_name.c_str());
-                    create_event<KFile*>(w, nullptr);
-                    return;
-                }
-
-                // Create file and add to file list node.
-                // Ref count is 1 by default.
-                file = new FSFile(resp.data.open.inode_index, resp.data.open.permissions);
-                printf("kopen: getting inode number\n");
-                printf("kopen: core %d: File Inode Index = %d\n", getCoreID(),
-                       file->get_inode_number());
-                open_files.add(new FileListNode(file, cleaned_file_name.hash()));
-
-                // Create event.
-                create_event<KFile*>(w, file);
-            };
-
-            fs::issue_fs_open(cleaned_file_name, callback);
-        } else if (cleaned_file_name.starts_with("/dev/ramfs/")) {
-            DeviceFile* f = new DeviceFile(cleaned_file_name);
-            create_event<KFile*>(w, f);
-        } else {
-            K::assert(false, "other device files not supported!");
-        }
-    });
+        };
+
+        fs::issue_fs_open(cleaned_file_name, callback);
+    } else if (cleaned_file_name.starts_with("/dev/ramfs/")) {
+        DeviceFile* f = new DeviceFile(cleaned_file_name);
+        create_event<KFile*>(w, f);
+    } else {
+        K::assert(false, "other device files not supported!");
+    }
 }
 
 void kclose(KFile* file) {
@@ -4,200 +4,292 @@
 #include "stdint.h"
 // #include <stdint.h>
 // #include "blocking_lock.h"
+#include "alloc_profile.h"
 #include "atomic.h"
+#include "frame.h"
 #include "libk.h"
+#include "slab.h"
+#include "vm.h"
 
 static SpinLock* theLock = nullptr;
+static uint64_t allocation_count = 0;  // bumped under theLock
 // MY HEAP
-// A sample pointer to the start of the free list.
-memory_block_t* free_head;
+// segregated free lists, a set bit in nonempty_lists means that list has blocks
+static memory_block_t* free_lists[HEAP_LISTS];
+static uint64_t nonempty_lists = 0;
+static size_t free_bytes = 0;
+
+// the range uinit was given
+static memory_block_t* initial_base = nullptr;
+static size_t initial_bytes = 0;
+
+// chunks extend took from the frame allocator, the initial heap is not one
+struct HeapRegion {
+    memory_block_t* base;
+    size_t bytes;
+};
+static HeapRegion regions[HEAP_MAX_REGIONS];
+static int region_count = 0;
 
 namespace heapHelpers {
 /*
  * is_allocated - returns true if a block is marked as allocated.
  */
 bool is_allocated(memory_block_t* block) {
-    // assert(block != nullptr);
     return block->block_size_alloc & 0x1;
 }
 
 /*
- * allocate - marks a block as allocated.
+ * prev_allocated - returns true if the block right before this one is in use.
  */
-void allocate(memory_block_t* block) {
-    // assert(block != nullptr);
-    block->block_size_alloc |= 0x1;
+bool prev_allocated(memory_block_t* block) {
+    return block->block_size_alloc & PREV_ALLOC;
 }
 
 /*
- * deallocate - marks a block as unallocated.
+ * get_size - gets the size of the block.
  */
-void deallocate(memory_block_t* block) {
-    // assert(block != nullptr);
-    block->block_size_alloc &= ~0x1;
+size_t get_block_size(memory_block_t* block) {
+    return block->block_size_alloc & ~(ALIGNMENT - 1);
 }
 
 /*
- * get_size - gets the size of the block.
+ * get_payload - gets the payload of the block.
  */
-size_t get_block_size(memory_block_t* block) {
-    // assert(block != nullptr);
-    return block->block_size_alloc & ~(ALIGNMENT - 1);
+void* get_payload(memory_block_t* block) {
+    return (void*)(block + 1);
 }
 
 /*
- * get_next - gets the next block.
+ * get_block - given a payload, returns the block.
  */
-memory_block_t* get_next(memory_block_t* block) {
-    // assert(block != nullptr);
-    return block->next;
+memory_block_t* get_block(void* payload) {
+    return ((memory_block_t*)payload) - 1;
 }
 
 /*
- * put_block - puts a block struct into memory at the specified address.
- * Initializes the size and allocated fields, along with NUlling out the next
- * field.
+ * neighbours in memory, prev_block is only valid while the previous block is
+ * free and so has a footer
  */
-void put_block(memory_block_t* block, size_t size, bool alloc) {
-    // assert(block != nullptr);
-    // assert(size % ALIGNMENT == 0);
-    // assert(alloc >> 1 == 0);
-    block->block_size_alloc = size | alloc;
-    block->next = nullptr;
+memory_block_t* next_block(memory_block_t* block) {
+    return (memory_block_t*)((char*)block + get_block_size(block));
+}
+
+memory_block_t* prev_block(memory_block_t* block) {
+    size_t prev_size = *((size_t*)block - 1);
+    return (memory_block_t*)((char*)block - prev_size);
 }
 
 /*
- * get_payload - gets the payload of the block.
+ * prev link of a free block, kept in the first word of its payload
  */
-void* get_payload(memory_block_t* block) {
-    // assert(block != nullptr);
-    return (void*)(block + 1);
+memory_block_t*& prev_free(memory_block_t* block) {
+    return *(memory_block_t**)get_payload(block);
+}
+
+void set_prev_allocated(memory_block_t* block, bool alloc) {
+    if (alloc) {
+        block->block_size_alloc |= PREV_ALLOC;
+    } else {
+        block->block_size_alloc &= ~PREV_ALLOC;
+    }
 }
 
 /*
- * get_block - given a payload, returns the block.
+ * put_free - writes the header and footer of a free block and tells the block
+ * after it.
  */
-memory_block_t* get_block(void* payload) {
-    // assert(payload != nullptr);
-    return ((memory_block_t*)payload) - 1;
+void put_free(memory_block_t* block, size_t size, bool prev_alloc) {
+    block->block_size_alloc = size | (prev_alloc ? PREV_ALLOC : 0);
+    *(size_t*)((char*)block + size - sizeof(size_t)) = size;
+    set_prev_allocated(next_block(block), false);
 }
 
 /*
- * The following are helper functions that can be implemented to assist in your
- * design, but they are not required.
+ * put_allocated - marks a block of size bytes as in use, keeping what it
+ * knows about the block before it. The prev link and footer it had while free
+ * are cleared, so the payload goes out zeroed.
  */
+void put_allocated(memory_block_t* block, size_t size) {
+    block->block_size_alloc = size | (block->block_size_alloc & PREV_ALLOC) | 0x1;
+    block->next = nullptr;
+    prev_free(block) = nullptr;
+    *(size_t*)((char*)block + size - sizeof(size_t)) = 0;
+    set_prev_allocated(next_block(block), true);
+}
+
+int list_index(size_t size) {
+    int index = 63 - __builtin_clzl(size);
+    return index < HEAP_LISTS ? index : HEAP_LISTS - 1;
+}
+
+void insert_free(memory_block_t* block) {
+    size_t size = get_block_size(block);
+    int index = list_index(size);
+    block->next = free_lists[index];
+    prev_free(block) = nullptr;
+    if (free_lists[index] != nullptr) {
+        prev_free(free_lists[index]) = block;
+    }
+    free_lists[index] = block;
+    nonempty_lists |= 1ull << index;
+    free_bytes += size;
+}
+
+void unlink_free(memory_block_t* block) {
+    size_t size = get_block_size(block);
+    int index = list_index(size);
+    memory_block_t* prev = prev_free(block);
+    if (prev != nullptr) {
+        prev->next = block->next;
+    } else {
+        free_lists[index] = block->next;
+    }
+    if (block->next != nullptr) {
+        prev_free(block->next) = prev;
+    }
+    if (free_lists[index] == nullptr) {
+        nonempty_lists &= ~(1ull << index);
+    }
+    free_bytes -= size;
+}
 
 /*
- * find - finds a free block that can satisfy the umalloc request.
+ * find - finds a free block that can satisfy the umalloc request. Its own
+ * list may hold blocks that are too small so it is searched first fit, any
+ * block on a higher list is big enough.
  */
 memory_block_t* find(size_t size) {
-    memory_block_t* cur = free_head;
-    memory_block_t* best = nullptr;
-    while (cur != nullptr) {
-        if (best == nullptr && cur->block_size_alloc >= size) {
-            best = cur;
-        } else if (best != nullptr && cur->block_size_alloc < best->block_size_alloc &&
-                   cur->block_size_alloc >= size) {
-            best = cur;
-        }
-        if (best != nullptr) {
-            if (best->block_size_alloc == size) return best;
-        }
-        cur = cur->next;
+    int index = list_index(size);
+    for (memory_block_t* cur = free_lists[index]; cur != nullptr; cur = cur->next) {
+        if (get_block_size(cur) >= size) return cur;
     }
-    return best;
+    uint64_t above = nonempty_lists & ~((2ull << index) - 1);
+    if (above == 0) {
+        return nullptr;
+    }
+    return free_lists[__builtin_ctzl(above)];
+}
+
+/*
+ * place_region - lays a range out as one free block followed by an allocated
+ * end marker, the same shape uinit gives the initial heap.
+ */
+memory_block_t* place_region(void* base, size_t bytes) {
+    memory_block_t* first = (memory_block_t*)base;
+    memory_block_t* end = (memory_block_t*)((char*)base + bytes - sizeof(memory_block_t));
+    end->block_size_alloc = 0x1;  // size 0, allocated
+    end->next = nullptr;
+    put_free(first, bytes - sizeof(memory_block_t), true);
+    insert_free(first);
+    return first;
 }
 
 /*
- * extend - extends the heap if more memory is required.
+ * extend - extends the heap if more memory is required, pulling at least
+ * HEAP_GROW_BYTES of contiguous frames from the frame allocator.
  * returns memory block that we added.
  */
 memory_block_t* extend(size_t size) {
-    K::assert(false, "we are out of heap space");
-    return nullptr;
-    /*
-    size = ALIGN(size);
-    if (size > PAGESIZE)
-    {
-        size = PAGESIZE;
-    }
-    memory_block_t *increase = (memory_block_t *)alloc_frame(size);
-    deallocate(increase);
-    increase->next = nullptr;
-    increase->block_size_alloc = size;
-    if (free_head == nullptr) // completely out of free mem, need a new head
-    {
-        free_head = increase;
-    }
-    else if (increase < free_head)
-    {
-        increase->next = free_head;
-        free_head = increase;
-        return increase;
+    size_t bytes = size + sizeof(memory_block_t);
+    bytes = (bytes + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+    if (bytes < HEAP_GROW_BYTES) {
+        bytes = HEAP_GROW_BYTES;
     }
-    else
-    {
-        memory_block_t *cur = free_head;
-        while (cur->next != nullptr && cur->next < increase)
-        { // add added mem to the end
-            cur = cur->next;
-        }
-        increase->next = cur->next;
-        cur->next = increase;
-    }
-    return increase;
-    */
+    K::assert(region_count < HEAP_MAX_REGIONS, "we are out of heap space");
+    uint64_t paddr = alloc_frame_run(bytes / PAGE_SIZE);
+    K::assert(paddr != 0, "we are out of heap space");
+
+    void* base = (void*)paddr_to_vaddr(paddr);
+    // frames come back with whatever their last owner left, heap memory is
+    // handed out zeroed
+    K::memset(base, 0, bytes);
+    regions[region_count].base = (memory_block_t*)base;
+    regions[region_count].bytes = bytes;
+    region_count++;
+    return place_region(base, bytes);
 }
 
 /*
- * split - splits a given block in parts, one allocated, one free.
- * handles all the freeblock list linking. return the block that is allocated.
+ * split - carves size bytes off the front of a free block that is already
+ * off its list, the rest goes back on the free lists if it is big enough to
+ * be a block. returns the block that is allocated.
  */
 memory_block_t* split(memory_block_t* block, size_t size) {
-    // new address of the block we want to allocate
-    memory_block_t* toAllocate = (memory_block_t*)((char*)block + block->block_size_alloc - size);
-    // the size of the new head is the remaining memory space in the original
-    // block
-    block->block_size_alloc = block->block_size_alloc - size;
-    allocate(toAllocate);
-    toAllocate->block_size_alloc = size;
-    toAllocate->next = nullptr;
-    return toAllocate;
+    size_t total = get_block_size(block);
+    if (total - size >= HEAP_MIN_BLOCK) {
+        memory_block_t* rest = (memory_block_t*)((char*)block + size);
+        put_free(rest, total - size, true);
+        insert_free(rest);
+    } else {
+        size = total;
+    }
+    put_allocated(block, size);
+    return block;
 }
 
 /*
- * coalesce - coalesces a free memory block with neighbors.
+ * coalesce - merges a block that was just freed with whichever of its two
+ * neighbours are free, the boundary tags make this O(1). returns the merged
+ * block, it is not on a free list yet.
  */
 memory_block_t* coalesce(memory_block_t* block) {
-    memory_block_t* cur = free_head;
-    while (cur) {
-        if (cur->next != nullptr &&
-            cur->next == (memory_block_t*)((char*)cur + cur->block_size_alloc)) {  // neighbors !
-            cur->block_size_alloc = cur->block_size_alloc + cur->next->block_size_alloc;
-            cur->next = cur->next->next;
-        }
-        cur = cur->next;
+    size_t size = get_block_size(block);
+    bool prev_alloc = prev_allocated(block);
+
+    // the tags a merged neighbour leaves inside the new block are cleared,
+    // everything else in a free block is already zero
+    memory_block_t* next = next_block(block);
+    if (!is_allocated(next)) {
+        unlink_free(next);
+        size += get_block_size(next);
+        K::memset(next, 0, sizeof(memory_block_t) + sizeof(memory_block_t*));
+    }
+    if (!prev_alloc) {
+        memory_block_t* prev = prev_block(block);
+        unlink_free(prev);
+        size += get_block_size(prev);
+        prev_alloc = prev_allocated(prev);  // always true, free blocks never touch
+        K::memset((size_t*)block - 1, 0, sizeof(size_t) + sizeof(memory_block_t));
+        block = prev;
     }
+    put_free(block, size, prev_alloc);
     return block;
 }
 };  // namespace heapHelpers
 
 /*
  * uinit - Used initialize metadata required to manage the heap
- * along with allocating initial memory.
+ * along with allocating initial memory. The last header's worth of the range
+ * is an allocated end marker, so nothing ever merges past it.
  */
 void uinit(void* base, size_t bytes) {
     using namespace heapHelpers;
-    free_head = (memory_block_t*)base;
-    printf("| heap range 0x%x 0x%x\n", (uint64_t)free_head, (uint64_t)free_head + bytes);
-    // free_head = (memory_block_t *)csbrk(PAGESIZE * 4);
-    if (free_head == nullptr) {
-        // return -1;
-    }
-    put_block(free_head, bytes, false);
-    free_head->next = nullptr;
+    memory_block_t* first = (memory_block_t*)base;
+    printf("| heap range 0x%x 0x%x\n", (uint64_t)first, (uint64_t)first + bytes);
+    bytes &= ~(ALIGNMENT - 1);
+    place_region(first, bytes);
+    initial_base = first;
+    initial_bytes = bytes;
+
     // initialize lock
     theLock = new SpinLock();
+    lock_profile_name(theLock, "heap");
+    slab_init();
+}
+
+/*
+ * alloc_for - small requests come from the per-core slab caches, caller is
+ * who the allocation profiler charges it to.
+ */
+static void* alloc_for(size_t size, void* caller) {
+    void* payload = size <= SLAB_MAX_SIZE ? slab_alloc(size) : heap_alloc(size);
+#ifdef ALLOC_PROFILE
+    alloc_profile_alloc(payload, caller);
+#else
+    (void)caller;
+#endif
+    return payload;
 }
 
 /*
@@ -205,52 +297,45 @@ void uinit(void* base, size_t bytes) {
  * memory.
  */
 void* kmalloc(size_t size) {
+    return alloc_for(size, __builtin_return_address(0));
+}
+
+/*
+ * heap_alloc - segregated fit allocation straight from the free lists.
+ */
+void* heap_alloc(size_t size, size_t flags) {
     using namespace heapHelpers;
     // lock
     LockGuardP g{theLock};
     size = ALIGN(size + sizeof(memory_block_t));
-    // we have a valid block size. now we can allocate
+    if (size < HEAP_MIN_BLOCK) {
+        size = HEAP_MIN_BLOCK;
+    }
     memory_block_t* validBlock = find(size);
     while (validBlock == nullptr) {
-        coalesce(free_head);  // check for another block
+        extend(size);
         validBlock = find(size);
-        if (validBlock == nullptr) {
-            // OUT OF HEAP MEMORY. I WILL SPIN 4 EVER UNTIL EXTEND WORKS
-            // I should block and try again but no blocking locks either
-            memory_block_t* temp = extend(size * 2);
-            if (temp && temp->block_size_alloc >= size) {
-                validBlock = temp;
-            }
-        }
     }
-    if (validBlock->block_size_alloc >= 2 * size) {
-        validBlock = split(validBlock, size);
-    } else {
-        if (validBlock == free_head)  // unlink head
-        {
-            free_head = free_head->next;
-        } else  // unlink block inside of list
-        {
-            memory_block_t* cur = free_head->next;
-            memory_block_t* prev = free_head;
-            while (cur < validBlock) {
-                prev = cur;
-                cur = cur->next;
-            }
-            prev->next = cur->next;
-        }
-    }
-    allocate(validBlock);  // mark block as allocated
-    validBlock->next = nullptr;
+    unlink_free(validBlock);
+    validBlock = split(validBlock, size);
+    validBlock->block_size_alloc |= flags;
+    allocation_count++;
 
     return get_payload(validBlock);
 }
 
+/**
+ * number of kmalloc calls so far, for measuring how allocation heavy a path is
+ */
+uint64_t heap_allocation_count() {
+    return allocation_count + slab_allocation_count();
+}
+
 /**
  * kcalloc -  count amount of size objects all zeroed.
  */
 void* kcalloc(size_t count, size_t size) {
-    void* block = kmalloc(count * size);
+    void* block = alloc_for(count * size, __builtin_return_address(0));
     K::memset(block, 0, count * size);
     return block;
 }
@@ -260,32 +345,114 @@ void* kcalloc(size_t count, size_t size) {
  * called by a previous call to malloc.
  */
 void kfree(void* ptr) {
+#ifdef ALLOC_PROFILE
+    alloc_profile_free(ptr);
+#endif
+    if (heapHelpers::get_block(ptr)->block_size_alloc & SLAB_BLOCK) {
+        slab_free(ptr);
+        return;
+    }
+    heap_free(ptr);
+}
+
+/*
+ * heap_free - merges the block with its free neighbours and puts the result
+ * on its free list.
+ */
+void heap_free(void* ptr) {
     using namespace heapHelpers;
     LockGuardP g{theLock};
-    // assert(ptr != nullptr);                        // check for null pointer
     memory_block_t* freeBlock = get_block(ptr);  // block we want to add back to free list
-    K::memset(ptr, 0, freeBlock->block_size_alloc & ~0x1);
-    deallocate(freeBlock);
-    if (free_head == nullptr)  // list is empty, make block the head
-    {
-        free_head = freeBlock;
-    } else if (freeBlock < free_head) {  // block needs to be head
-        freeBlock->next = free_head;
-        free_head = freeBlock;
-    } else  // find spot in list for the block
+    K::memset(ptr, 0, get_block_size(freeBlock) - sizeof(memory_block_t));
+    insert_free(coalesce(freeBlock));
+}
+
+/*
+ * heap_trim - hands every grown chunk that is entirely free back to the frame
+ * allocator. The frames are released after the heap lock is dropped so the
+ * frame lock is never taken inside it from this side.
+ */
+size_t heap_trim() {
+    using namespace heapHelpers;
+    HeapRegion idle[HEAP_MAX_REGIONS];
+    int idle_count = 0;
     {
-        memory_block_t* cur = free_head;
-        while (cur->next != nullptr && freeBlock > cur) {
-            if (freeBlock < cur->next) {
-                freeBlock->next = cur->next;
-                cur->next = freeBlock;
-                return;
+        LockGuardP g{theLock};
+        for (int i = region_count - 1; i >= 0; i--) {
+            memory_block_t* first = regions[i].base;
+            if (is_allocated(first) ||
+                get_block_size(first) != regions[i].bytes - sizeof(memory_block_t)) {
+                continue;
             }
-            cur = cur->next;
-        }  // add free block to end of the list
-        cur->next = freeBlock;
+            unlink_free(first);
+            idle[idle_count++] = regions[i];
+            regions[i] = regions[--region_count];
+        }
+    }
+    size_t released = 0;
+    for (int i = 0; i < idle_count; i++) {
+        free_frame_run(vaddr_to_paddr((uint64_t)idle[i].base), idle[i].bytes / PAGE_SIZE);
+        released += idle[i].bytes;
+    }
+    return released;
+}
+
+/*
+ * walk_region - visits every allocated object from base up to the end
+ * marker, stepping into the chunks the slab caches carve their objects from.
+ */
+static void walk_region(memory_block_t* base, void (*visit)(memory_block_t*)) {
+    using namespace heapHelpers;
+    for (memory_block_t* block = base; get_block_size(block) != 0; block = next_block(block)) {
+        if (!is_allocated(block)) {
+            continue;
+        }
+        if (!(block->block_size_alloc & SLAB_CHUNK)) {
+            visit(block);
+            continue;
+        }
+        memory_block_t* object = (memory_block_t*)get_payload(block);
+        size_t object_size = sizeof(memory_block_t) + get_block_size(object);
+        if (object_size == sizeof(memory_block_t)) {
+            continue;  // still being carved
+        }
+        size_t count = (get_block_size(block) - sizeof(memory_block_t)) / object_size;
+        for (size_t i = 0; i < count; i++) {
+            visit((memory_block_t*)((char*)object + i * object_size));
+        }
+    }
+}
+
+void heap_walk(void (*visit)(memory_block_t* block)) {
+    LockGuardP g{theLock};
+    walk_region(initial_base, visit);
+    for (int i = 0; i < region_count; i++) {
+        walk_region(regions[i].base, visit);
+    }
+}
+
+void heap_stats(HeapStats* stats) {
+    using namespace heapHelpers;
+    LockGuardP g{theLock};
+    stats->free_bytes = free_bytes;
+    stats->largest_free = 0;
+    stats->free_blocks = 0;
+    for (int i = 0; i < HEAP_LISTS; i++) {
+        for (memory_block_t* cur = free_lists[i]; cur != nullptr; cur = cur->next) {
+            size_t size = get_block_size(cur);
+            if (size > stats->largest_free) stats->largest_free = size;
+            stats->free_blocks++;
+        }
+    }
+}
+
+uint32_t heap_fragmentation() {
+    HeapStats stats;
+    heap_stats(&stats);
+    if (stats.free_bytes == 0) {
+        return 0;
     }
-    return;
+    return 100 - (uint32_t)((stats.largest_free * 100) / stats.free_bytes);
 }
 
 /*****************/
@@ -294,7 +461,7 @@ void kfree(void* ptr) {
 // typedef long unsigned int size_t;
 
 void* operator new(size_t size) {
-    void* p = kmalloc(size);
+    void* p = alloc_for(size, __builtin_return_address(0));
     // if (p == 0) Debug::panic("out of memory");
     return p;
 }
@@ -310,7 +477,7 @@ void operator delete(void* p, size_t sz) {
 }
 
 void* operator new[](size_t size) {
-    void* p = kmalloc(size);
+    void* p = alloc_for(size, __builtin_return_address(0));
     // if (p == 0) Debug::panic("out of memory");
     return p;
 }
@@ -8,6 +8,7 @@
 #include "printf.h"
 #include "sys.h"
 #include "timer.h"
+#include "timer_wheel.h"
 #include "utils.h"
 
 /*
@@ -25,6 +26,17 @@ void enable_interrupt_controller() {
     put32(ENABLE_IRQS_1, SYSTEM_TIMER_IRQ_1);
 }
 
+/**
+ * rings mailbox 0 of the target core, used to wake it out of wfi
+ */
+void send_ipi(int core) {
+    put32(CORE0_MBOX0_SET + 4 * core, 1);
+}
+
+void clear_ipi(int core) {
+    put32(CORE0_MBOX0_RDCLR + 4 * core, 0xFFFFFFFF);
+}
+
 extern "C" void handle_irq(KernelEntryFrame* frame) {
     auto me = getCoreID();
     auto event = get_running_task(me);
@@ -41,22 +53,21 @@ extern "C" void handle_irq(KernelEntryFrame* frame) {
         irq_source.Raw32 = QA7->Core3IRQSource.Raw32;
     }
 
-    if (irq_source.Timer_Int) {
-        //  printf("Core %d in timer irq\n", getCoreID());
+    if (irq_source.CNTVIRQ) {
+        // queues expired sleepers, may be pending alongside the others
+        timer_wheel_irq();
+    }
+    if (irq_source.CNTPNSIRQ) {
+        // quantum is up, enter_user_space arms a fresh one for whatever runs next
+        disarm_preempt_timer();
         yield(frame);
-        QA7->TimerClearReload.IntClear = 1;  // Clear interrupt
-        if (me == 0) {
-            QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE1_IRQ;
-        } else if (me == 1) {
-            QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE2_IRQ;
-        } else if (me == 2) {
-            QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE3_IRQ;
-        } else {
-            QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE0_IRQ;
-        }
-        QA7->TimerClearReload.Reload = 1;  // Reload now
-    } else {
+    } else if (irq_source.Mailbox0_Int) {
+        // woken by another core, the event loop will pick up the new work
+        clear_ipi(me);
+    } else if (!irq_source.CNTVIRQ) {
         printf("UNKNOWN irq: 0x%x,  Core %d in irq\n", irq_source.Raw32, me);
     }
+    // work may have shown up for a core that skipped its tick
+    check_preempt_timer(me);
     Interrupts::restore(event->irq_was_disabled);
 }
@@ -1,3 +1,4 @@
+#include "alloc_profile.h"
 #include "core.h"
 #include "dcache.h"
 #include "dwc.h"
@@ -102,6 +103,18 @@ extern "C" void kernel_main() {
     // ramfs_tests();
     // sdioTests();
     // ring_buffer_tests();
+    // work_stealing_queue_tests();
+    // ready_queue_batch_benchmark();
+    // inbox_tests();
+    // spinlock_benchmark();
+    // atomic_tests();
+    // lock_profile_report(10);  // needs a LOCK_PROFILE=1 build
+    // alloc_profile_report(10, 1000000);  // needs an ALLOC_PROFILE=1 build
+    // affinity_tests();
+    // wait_queue_tests();
+    // timer_wheel_tests();
+    // epoch_tests();
+    // kfile_refcount_tests();
     elf_load_test();
     // partitionTests();
     // stringTest();
@@ -201,7 +214,8 @@ extern "C" void primary_kernel_init() {
 
 void mergeCores() {
     printf("Hi, I'm core %d\n", getCoreID());
-    auto number_awake = coresAwake.add_fetch(1);
+    // only counts, the barrier below orders everything else
+    auto number_awake = coresAwake.add_fetch(1, MemoryOrder::relaxed);
     printf("There are %d cores awake\n", number_awake);
     K::check_stack();
     starting->sync();
@@ -4,13 +4,16 @@
 #include "atomic.h"
 #include "bitmap.h"
 #include "elf_loader.h"
+#include "epoch.h"
 #include "event.h"
 #include "frame.h"
 #include "fs_init.h"
+#include "future.h"
 #include "hash.h"
 #include "heap.h"
 #include "libk.h"
 #include "locked_queue.h"
+#include "mpsc_inbox.h"
 #include "mmap.h"
 #include "printf.h"
 #include "queue.h"
@@ -18,11 +21,16 @@
 #include "rand.h"
 #include "ring_buffer.h"
 #include "sched.h"
+#include "slab.h"
 #include "sdio.h"
 #include "stdint.h"
 #include "string.h"
 #include "swap.h"
+#include "tcb_pool.h"
+#include "timer.h"
 #include "vm.h"
+#include "wait_queue.h"
+#include "work_stealing_queue.h"
 
 #define NUM_TIMES 1000
 
@@ -151,6 +159,176 @@ void ring_buffer_tests() {
     });
 }
 
+struct StealNode {
+    StealNode* next;
+    int value;
+};
+
+void work_stealing_queue_tests() {
+    printf("Starting Work Stealing Queue Tests\n");
+
+    auto* victim = new WorkStealingQueue<StealNode, 8>();
+    auto* thief = new WorkStealingQueue<StealNode, 8>();
+    StealNode nodes[10];
+    for (int i = 0; i < 10; i++) {
+        nodes[i].value = i;
+        victim->push(&nodes[i]);  // last 2 spill into the overflow queue
+    }
+
+    K::assert(thief->steal_from(*victim) == 4, "expected to steal half of the ring");
+    K::assert(thief->steal_from(*victim) == 0, "stole into a non-empty ring");
+    for (int i = 0; i < 4; i++) {
+        K::assert(thief->pop()->value == i, "thief popped out of order");
+    }
+    K::assert(thief->pop() == nullptr, "thief should be empty");
+
+    for (int i = 4; i < 10; i++) {
+        K::assert(victim->pop()->value == i, "victim popped out of order");
+    }
+    K::assert(victim->pop() == nullptr, "victim should be empty");
+    K::assert(thief->steal_from(*victim) == 0, "stole from an empty queue");
+
+    // a spilled node gets its turn even though the ring never drains
+    for (int i = 0; i < 9; i++) {
+        victim->push(&nodes[i]);
+    }
+    bool spilled_ran = false;
+    for (int i = 0; i < 24 && !spilled_ran; i++) {
+        StealNode* it = victim->pop();
+        spilled_ran = it == &nodes[8];
+        victim->push(it);
+    }
+    K::assert(spilled_ran, "spilled node starved behind a busy ring");
+    while (victim->pop() != nullptr) {
+    }
+
+    delete victim;
+    delete thief;
+    printf("Work Stealing Queue Tests passed\n");
+}
+
+void atomic_tests() {
+    printf("Starting atomic tests\n");
+    Atomic<uint64_t> big(0xFFFFFFFFull);
+    K::assert(big.add_fetch(1, MemoryOrder::relaxed) == 0x100000000ull,
+              "64 bit add lost the carry\n");
+
+    uint64_t expected = 0;
+    K::assert(!big.compare_exchange(expected, 5), "compare_exchange took a stale value\n");
+    K::assert(expected == 0x100000000ull, "failed compare_exchange did not report the value\n");
+    K::assert(big.compare_exchange(expected, 5, MemoryOrder::acq_rel),
+              "compare_exchange failed on the current value\n");
+    K::assert(big.get(MemoryOrder::acquire) == 5, "compare_exchange did not store\n");
+
+    Atomic<int64_t> signed_value(-1);
+    signed_value.set(-(1ll << 40), MemoryOrder::release);
+    K::assert(signed_value.fetch_add(1) == -(1ll << 40), "64 bit signed fetch_add\n");
+    printf("atomic tests passed\n");
+}
+
+static SpinLock benchLock;
+static uint64_t benchCounter = 0;
+static uint64_t benchTicks[CORE_COUNT];
+
+/**
+ * every core takes the same SpinLock back to back, build with
+ * SPINLOCK_IMPL=SPINLOCK_TAS and SPINLOCK_TICKET to compare the two
+ */
+void spinlock_benchmark() {
+    const int rounds = 100000;
+    printf("Starting spinlock benchmark (%s)\n",
+           SPINLOCK_IMPL == SPINLOCK_TICKET ? "ticket" : "test-and-set");
+    benchCounter = 0;
+    Atomic<uint32_t>* finished = new Atomic<uint32_t>(0);
+    for (int core = 0; core < CORE_COUNT; core++) {
+        create_event_on(core, [finished, rounds] {
+            int me = getCoreID();
+            uint64_t start = get_ticks();
+            for (int i = 0; i < rounds; i++) {
+                benchLock.lock();
+                benchCounter++;
+                benchLock.unlock();
+            }
+            benchTicks[me] = get_ticks() - start;
+            if (finished->add_fetch(1) == CORE_COUNT) {
+                K::assert(benchCounter == (uint64_t)rounds * CORE_COUNT, "spinlock lost an update\n");
+                for (int c = 0; c < CORE_COUNT; c++) {
+                    printf("core %d: %d acquisitions in %dus\n", c, rounds,
+                           ticks_to_us(benchTicks[c]));
+                }
+                delete finished;
+            }
+        });
+    }
+}
+
+void inbox_tests() {
+    printf("Starting inbox tests\n");
+    auto* inbox = new MpscInbox<StealNode>();
+    StealNode nodes[8];
+    K::assert(inbox->take_all() == nullptr, "new inbox should be empty\n");
+    for (int i = 0; i < 8; i++) {
+        nodes[i].value = i;
+        K::assert(inbox->push(&nodes[i]) == (i == 0), "push misreported an empty inbox\n");
+    }
+    StealNode* it = inbox->take_all();
+    for (int i = 0; i < 8; i++, it = it->next) {
+        K::assert(it != nullptr && it->value == i, "inbox lost posting order\n");
+    }
+    K::assert(it == nullptr && inbox->empty(), "inbox not drained\n");
+    delete inbox;
+
+    // three posts before it gets to run collapse into a single run
+    int* runs = new int(0);
+    IrqEvent* event = new IrqEvent(getCoreID(), [runs] { (*runs)++; });
+    bool was = Interrupts::disable();
+    event->post();
+    event->post();
+    event->post();
+    Interrupts::restore(was);
+    create_event_after(10000, [runs, event] {
+        K::assert(*runs == 1, "irq event posts were not folded\n");
+        delete event;
+        delete runs;
+        printf("inbox tests passed\n");
+    });
+}
+
+/**
+ * queues more work than a ready queue's ring holds, the way a burst of
+ * queue_on_core does, and drains it the way the owner does, reporting
+ * overflow lock acquisitions per dispatched item with a batch of 1 (the old
+ * one lock per remove) and with the default batch
+ */
+void ready_queue_batch_benchmark() {
+    const int items = 1024;
+    StealNode* nodes = new StealNode[items];
+    uint32_t batches[] = {1, OVERFLOW_BATCH};
+
+    for (uint32_t b : batches) {
+        auto* queue = new WorkStealingQueue<StealNode, READY_QUEUE_SLOTS>();
+        queue->set_batch(b);
+        for (int i = 0; i < items; i++) {
+            nodes[i].value = i;
+            queue->push(&nodes[i]);  // everything past the ring spills
+        }
+
+        uint64_t before = queue->lock_acquisitions();
+        uint64_t start = get_ticks();
+        for (int i = 0; i < items; i++) {
+            K::assert(queue->pop()->value == i, "batched pop out of order\n");
+        }
+        uint64_t elapsed = ticks_to_us(get_ticks() - start);
+        K::assert(queue->pop() == nullptr, "queue should be empty\n");
+        uint64_t locks = queue->lock_acquisitions() - before;
+
+        printf("batch %d: %d lock acquisitions for %d dispatches (%d per 100), %dus\n", b, locks,
+               items, (locks * 100) / items, elapsed);
+        delete queue;
+    }
+    delete[] nodes;
+}
+
 void test_multiple_allocations() {
     printf("Test 2: Multiple Allocations\n");
 
@@ -227,11 +405,135 @@ void heapTests() {
     test_allocation_deletion_sequence();
     test_zero_allocation();
     test_nullptr_deletion();
+    slab_tests();
+    heap_coalesce_tests();
+    heap_grow_tests();
 
     printf("All tests completed.\n");
     printf("foo test\n");
 }
 
+void slab_tests() {
+    printf("Starting slab tests\n");
+    K::assert(slab_class(1) == 0 && slab_class(16) == 0, "smallest class is not 16 bytes\n");
+    K::assert(slab_class(17) == 1 && slab_class(2048) == SLAB_CLASSES - 1,
+              "request rounded to the wrong class\n");
+
+    // every class hands out aligned, distinct, zeroed objects
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        size_t size = slab_class_size(cls);
+        K::assert(slab_class(size) == cls, "class size maps to another class\n");
+        char* a = (char*)kmalloc(size);
+        char* b = (char*)kmalloc(size);
+        K::assert(a != b, "slab handed out the same object twice\n");
+        K::assert(((uint64_t)a % ALIGNMENT) == 0, "slab object is misaligned\n");
+        for (size_t i = 0; i < size; i++) {
+            K::assert(a[i] == 0, "slab object not zeroed\n");
+        }
+        K::memset(a, 0xAB, size);
+        kfree(a);
+        // lifo per core, the object just freed comes straight back
+        char* c = (char*)kmalloc(size);
+        K::assert(c == a, "slab did not reuse the last free\n");
+        K::assert(c[0] == 0 && c[size - 1] == 0, "freed slab object not zeroed\n");
+        kfree(b);
+        kfree(c);
+    }
+
+    // more than a batch forces a drain to the depot and a refill from it
+    void* objects[3 * SLAB_MAX_BATCH];
+    for (int i = 0; i < 3 * SLAB_MAX_BATCH; i++) {
+        objects[i] = kmalloc(24);
+    }
+    for (int i = 0; i < 3 * SLAB_MAX_BATCH; i++) {
+        kfree(objects[i]);
+    }
+
+    // big requests bypass the slabs
+    void* big = kmalloc(SLAB_MAX_SIZE + 1);
+    K::assert((((memory_block_t*)big - 1)->block_size_alloc & SLAB_BLOCK) == 0,
+              "large request served from a slab\n");
+    kfree(big);
+    printf("slab tests passed\n");
+}
+
+void heap_coalesce_tests() {
+    printf("Starting heap coalesce tests\n");
+    HeapStats before;
+    heap_stats(&before);
+
+    void* blocks[8];
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = kmalloc(SLAB_MAX_SIZE + 1 + i * 4096);
+    }
+    // every other block first, so each later free has to merge both ways
+    for (int i = 0; i < 8; i += 2) {
+        kfree(blocks[i]);
+    }
+    for (int i = 1; i < 8; i += 2) {
+        kfree(blocks[i]);
+    }
+
+    HeapStats after;
+    heap_stats(&after);
+    K::assert(after.free_bytes == before.free_bytes, "heap lost memory\n");
+    K::assert(after.free_blocks <= before.free_blocks, "freed neighbours were not merged\n");
+    printf("heap coalesce tests passed, fragmentation %d percent\n", heap_fragmentation());
+}
+
+void heap_grow_tests() {
+    printf("Starting heap grow tests\n");
+    heap_trim();  // start from the initial heap alone
+    HeapStats before;
+    heap_stats(&before);
+
+    // more than the heap has in one piece, so it has to grow into new frames
+    size_t size = before.largest_free + HEAP_GROW_BYTES / 2;
+    char* big = (char*)kmalloc(size);
+    K::assert(big != nullptr, "heap did not grow\n");
+    big[0] = 1;
+    big[size - 1] = 1;
+
+    K::assert(heap_trim() == 0, "heap trimmed a chunk that is in use\n");
+    kfree(big);
+    K::assert(heap_trim() >= size, "idle chunk was not given back\n");
+
+    HeapStats after;
+    heap_stats(&after);
+    K::assert(after.free_bytes == before.free_bytes, "heap lost memory across a trim\n");
+    printf("heap grow tests passed\n");
+}
+
+void tcb_pool_tests() {
+    printf("Starting TCB pool tests\n");
+
+    void* objects[3 * TCB_POOL_BATCH];
+    for (int i = 0; i < 3 * TCB_POOL_BATCH; i++) {
+        objects[i] = tcb_pool_alloc(sizeof(Event));
+        K::assert(objects[i] != nullptr, "tcb pool returned nullptr");
+        K::assert(((uint64_t)objects[i] % ALIGNMENT) == 0, "tcb pool object is misaligned");
+        for (int j = 0; j < i; j++) {
+            K::assert(objects[i] != objects[j], "tcb pool handed out the same object twice");
+        }
+    }
+
+    // freeing more than TCB_POOL_MAX_CACHED pushes a batch back to the depot
+    for (int i = 0; i < 3 * TCB_POOL_BATCH; i++) {
+        tcb_pool_free(objects[i], sizeof(Event));
+    }
+
+    void* first = tcb_pool_alloc(sizeof(Event));
+    tcb_pool_free(first, sizeof(Event));
+    void* reused = tcb_pool_alloc(sizeof(Event));
+    K::assert(reused == first, "tcb pool did not reuse the last free");
+    tcb_pool_free(reused, sizeof(Event));
+
+    UserTCB* tcb = new UserTCB();  // too big for the pool, must come from the heap
+    delete tcb;
+
+    printf("TCB pool tests passed\n");
+}
+
 void test_ref_lambda() {
     static int a = 0;
     Function<void()> lambda = [&]() {
@@ -249,16 +551,89 @@ void test_val_lambda() {
     create_event(lambda);
 }
 
+struct DropCounter {
+    int* drops;
+    DropCounter(int* drops) : drops(drops) {
+    }
+    DropCounter(const DropCounter& other) : drops(other.drops) {
+    }
+    ~DropCounter() {
+        *drops += 1;
+    }
+};
+
+void function_tests() {
+    printf("Starting Function tests\n");
+    int drops = 0;
+    {
+        DropCounter counter(&drops);
+        Function<int(int)> small = [counter](int x) { return x + 1; };
+        K::assert(small(1) == 2, "inline Function returned the wrong value");
+
+        uint64_t big[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+        Function<uint64_t()> large = [counter, big]() { return big[7]; };
+        K::assert(large() == 8, "heap Function returned the wrong value");
+
+        Function<int(int)> copy = small;
+        Function<uint64_t()> moved = K::move(large);
+        K::assert(copy(2) == 3, "copied Function returned the wrong value");
+        K::assert(moved() == 8, "moved Function returned the wrong value");
+        drops = 0;
+    }
+    // small, copy, moved and the original counter each own a DropCounter
+    K::assert(drops == 4, "Function did not destroy its captures");
+    printf("Function tests passed\n");
+}
+
+void future_tests() {
+    printf("Starting Future tests\n");
+
+    // ready futures chain without allocating or leaving this event
+    int steps = 0;
+    make_ready_future(1)
+        .then([&steps](int x) {
+            steps++;
+            return make_ready_future(x + 1);
+        })
+        .done([&steps](int x) {
+            steps++;
+            K::assert(x == 2, "ready chain passed the wrong value");
+        });
+    K::assert(steps == 2, "ready chain did not run inline");
+
+    // pending futures run their continuations inside resolve
+    Promise<uint64_t> promise;
+    uint64_t seen = 0;
+    promise.get_future()
+        .then([](uint64_t x) { return make_ready_future(x * 2); })
+        .done([&seen](uint64_t x) { seen = x; });
+    K::assert(seen == 0, "continuation ran before resolve");
+    promise.resolve(21);
+    K::assert(seen == 42, "resolve did not run the chain");
+
+    // a free lock is taken without going through the ready queue
+    Lock lock;
+    K::assert(acquire(lock).is_ready(), "uncontended acquire was not ready");
+    K::assert(!acquire(lock).is_ready(), "acquired a held lock");
+    lock.unlock();
+    printf("Future tests passed\n");
+}
+
 void event_loop_tests() {
     printf("Testing the event_loop..\n");
     test_ref_lambda();
     test_val_lambda();
+    function_tests();
+    future_tests();
+    tcb_pool_tests();
     printf("All tests completed.\n");
 }
 
 void frame_alloc_tests() {
     printf("Starting frame allocator tests...\n");
 
+    // first, the callbacks of the others free frames later on
+    test_frame_runs();
     test_frame_alloc_simple();
     test_frame_alloc_multiple();
     test_pin_frame();
@@ -266,6 +641,20 @@ void frame_alloc_tests() {
     printf("All frame allocator tests completed.\n");
 }
 
+void test_frame_runs() {
+    uint64_t before = free_frame_count();
+    uint64_t block = alloc_frame_run(512);
+    K::assert(block != 0, "no 2MB run of frames");
+    K::assert((block / PAGE_SIZE) % 512 == 0, "2MB run is not aligned");
+    uint64_t odd = alloc_frame_run(3);
+    K::assert(odd != 0, "no run of 3 frames");
+    K::assert(free_frame_count() == before - 515, "runs took the wrong number of frames");
+    free_frame_run(odd, 3);
+    free_frame_run(block, 512);
+    K::assert(free_frame_count() == before, "freed runs were not merged back");
+    printf("test_frame_runs passed\n");
+}
+
 void test_frame_alloc_simple() {
     Function<void(uint64_t)> lambda = [](uint64_t a) {
         printf("got address %d\n", a);
@@ -558,6 +947,232 @@ void semaphore_tests() {
     create_event(check_func);
 }
 
+void semaphore_fast_path_tests() {
+    Semaphore* sema = new Semaphore(1);
+    int* order = new int(0);
+
+    // a free unit runs the continuation before down() returns
+    sema->down([order] { *order = 1; });
+    K::assert(*order == 1, "uncontended down did not run inline\n");
+
+    // a taken one queues it until up()
+    sema->down([order] { *order = 3; });
+    K::assert(*order == 1, "contended down ran without a unit\n");
+    *order = 2;
+    sema->up();
+    create_event([sema, order] {
+        K::assert(*order == 3, "up did not hand the unit to the waiter\n");
+        K::assert(!sema->try_down(), "unit handed to a waiter was left free\n");
+        sema->up();
+        K::assert(sema->try_down(), "released unit not free\n");
+        delete sema;
+        delete order;
+        printf("semaphore fast path tests passed\n");
+    });
+}
+
+void rwlock_tests() {
+    RWLock* lock = new RWLock();
+    int* step = new int(0);
+
+    // free readers share the lock and run inline
+    lock->lock_shared([step] { *step += 1; });
+    lock->lock_shared([step] { *step += 1; });
+    K::assert(*step == 2, "uncontended readers did not run inline\n");
+    K::assert(!lock->try_lock(), "writer got in alongside readers\n");
+
+    // a writer queues behind them, and new readers queue behind the writer
+    lock->lock([lock, step] {
+        K::assert(*step == 2, "writer ran while readers held the lock\n");
+        *step = 3;
+        lock->unlock();
+    });
+    K::assert(!lock->try_lock_shared(), "reader overtook a queued writer\n");
+    lock->lock_shared([lock, step] {
+        K::assert(*step == 3, "queued reader ran before the writer\n");
+        lock->unlock_shared();
+        K::assert(lock->try_lock(), "drained lock not free\n");
+        lock->unlock();
+        delete lock;
+        delete step;
+        printf("rwlock tests passed\n");
+    });
+
+    // the last reader out hands the lock to the writer
+    lock->unlock_shared();
+    lock->unlock_shared();
+}
+
+void wait_queue_tests() {
+    printf("Starting wait queue tests\n");
+    WaitQueue queue;
+    UserTCB* a = new UserTCB();
+    UserTCB* b = new UserTCB();
+    UserTCB* c = new UserTCB();
+
+    queue.sleep(a);
+    queue.sleep(b);
+    K::assert(queue.size() == 2, "wait queue lost a sleeper\n");
+    K::assert(a->state == TASK_STOPPED, "sleeping TCB was not stopped\n");
+
+    volatile bool condition = false;
+    K::assert(!queue.sleep_if(c, condition), "slept after the condition was cleared\n");
+    condition = true;
+    K::assert(queue.sleep_if(c, condition), "did not sleep on a set condition\n");
+    K::assert(b->state == TASK_STOPPED && c->state == TASK_STOPPED,
+              "sleeping TCB was not stopped\n");
+
+    // killed sleepers go back through the ready queues and are freed there,
+    // another core may already have dropped them so a, b and c are gone now
+    K::assert(queue.kill_all() == 3, "kill_all missed a sleeper\n");
+    K::assert(queue.size() == 0, "wait queue not empty after kill_all\n");
+    printf("wait queue tests passed\n");
+}
+
+void timer_wheel_tests() {
+    printf("Starting timer wheel tests\n");
+    TimerWheel* wheel = new TimerWheel();
+    uint64_t delays[] = {1, 63, 64, 65, 4095, 4096, 300000, 20000000};
+    int n = sizeof(delays) / sizeof(delays[0]);
+    TCB* tcbs[8];
+    for (int i = 0; i < n; i++) {
+        tcbs[i] = new Event([] {});
+        tcbs[i]->wake_tick = delays[i];
+        wheel->add(tcbs[i]);
+    }
+
+    // every timer has to fire exactly on its tick, across each cascade
+    for (int i = 0; i < n; i++) {
+        K::assert(wheel->advance(delays[i] - 1) == nullptr, "timer fired early\n");
+        TCB* expired = wheel->advance(delays[i]);
+        K::assert(expired == tcbs[i] && expired->next == nullptr, "timer missed its tick\n");
+        delete expired;
+    }
+    K::assert(wheel->empty(), "timer wheel not empty after all expired\n");
+    delete wheel;
+
+    uint64_t start = get_systime();
+    create_event_after(5000, [start] {
+        uint64_t waited = get_systime() - start;
+        K::assert(waited >= 5000, "create_event_after ran early\n");
+        printf("timer wheel tests passed, slept %dus for 5000us\n", waited);
+    });
+}
+
+struct EpochProbe {
+    volatile bool* freed;
+
+    EpochProbe(volatile bool* freed) : freed(freed) {
+    }
+
+    ~EpochProbe() {
+        *freed = true;
+    }
+};
+
+// polls once a millisecond, every core has to pass a quiescent point in between
+static void wait_for_grace(volatile bool* freed, int tries, Function<void()> done) {
+    create_event_after(1000, [freed, tries, done]() mutable {
+        if (*freed) {
+            delete freed;
+            done();
+            return;
+        }
+        K::assert(tries > 0, "retired node never freed\n");
+        wait_for_grace(freed, tries - 1, done);
+    });
+}
+
+/**
+ * one core plays a CPU-bound user thread with its tick off: it publishes what
+ * enter_user_space does and then never gets back to run_events. A node
+ * retired on another core meanwhile still has to be freed.
+ */
+static void epoch_user_space_tests() {
+    volatile bool* release = new bool(false);
+    int other = (getCoreID() + 1) % CORE_COUNT;
+    create_event_on(other, [release] {
+        int me = getCoreID();
+        epoch_idle(me);
+        create_event_on((me + 1) % CORE_COUNT, [release] {
+            volatile bool* freed = new bool(false);
+            epoch_retire(new EpochProbe(freed));
+            wait_for_grace(freed, 1000, [release] {
+                *release = true;
+                printf("epoch tests passed\n");
+            });
+        });
+        while (!*release) {
+        }
+        // what trapping back in does
+        epoch_enter(me);
+        delete release;
+    });
+}
+
+void epoch_tests() {
+    printf("Starting epoch tests\n");
+    int me = getCoreID();
+    uint32_t pending = epoch_pending(me);
+
+    // a retired node outlives the event that retired it
+    volatile bool* freed = new bool(false);
+    epoch_retire(new EpochProbe(freed));
+    K::assert(!*freed, "retired node freed before a grace period\n");
+    K::assert(epoch_pending(me) == pending + 1, "retired node not queued\n");
+
+    // a retired pid disappears from lookups straight away
+    PCB* pcb = new PCB;
+    int pid = pcb->pid;
+    K::assert(task_lookup(pid) == pcb, "new PCB not published\n");
+    retire_task(pcb);
+    K::assert(task_lookup(pid) == nullptr, "retired PCB still published\n");
+
+    wait_for_grace(freed, 1000, [] { epoch_user_space_tests(); });
+}
+
+struct RefCountedTestFile : public KFile {
+    int get_inode_number() override {
+        return -1;
+    }
+};
+
+void kfile_refcount_tests() {
+    KFile* file = new RefCountedTestFile();
+    K::assert(file->get_ref_count() == 1, "new KFile does not start with one reference\n");
+    file->increment_ref_count_atomic();
+    K::assert(file->try_increment_ref_count(), "could not take a reference to a live file\n");
+    K::assert(file->get_ref_count() == 3, "lost a reference\n");
+
+    file->decrement_ref_count_atomic();
+    file->decrement_ref_count_atomic();
+    file->decrement_ref_count_atomic();
+
+    // retired but not freed yet, a lookup racing the last close must back off
+    K::assert(file->get_ref_count() == 0, "last reference not dropped\n");
+    K::assert(!file->try_increment_ref_count(), "revived a file with no references\n");
+    printf("kfile refcount tests passed\n");
+}
+
+void affinity_tests() {
+    printf("Starting affinity tests\n");
+    // only the home core is promised, an idle core may still steal the event
+    create_event_on(2, []() {
+        K::assert(get_running_task(getCoreID())->home_core == 2,
+                  "create_event_on did not set the home core\n");
+        // a plain event carries the home along, wherever it ends up running
+        create_event([]() {
+            K::assert(get_running_task(getCoreID())->home_core == 2,
+                      "event did not inherit its creator's home core\n");
+            create_event_inherit([]() {
+                K::assert(get_running_task(getCoreID())->home_core == 2,
+                          "create_event_inherit left the home core\n");
+                printf("affinity tests passed\n");
+            });
+        });
+    });
+}
+
 void lock_tests() {
     Semaphore* finish_sema = new Semaphore(-3);
     Lock* lock = new Lock();
@@ -593,7 +1208,9 @@ void lock_tests() {
 
 void blocking_atomic_tests() {
     semaphore_tests();
+    semaphore_fast_path_tests();
     lock_tests();
+    rwlock_tests();
 }
 
 void elf_load_test() {
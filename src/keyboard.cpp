@@ -23,114 +23,74 @@ uint64_t get_keyboard_input() {
     return *((uint64_t *)buffer);
 }
 
-void keyboard_loop() {
-    uint64_t input, prior;
-    uint8_t keyboard_state[256];
-    for (int i = 0; i < 256; i++) keyboard_state[i] = 0x00;
-
+// state carried from one poll to the next
+static uint8_t keyboard_state[256];
+static uint64_t prior;
+static uint8_t prior_modifiers;
+
+/**
+ * reads one HID report and turns the difference from the last one into key
+ * events, then schedules the next read instead of spinning on the usb bus
+ */
+static void keyboard_poll() {
     struct key_event events[12];
     uint8_t event_cnt = 0;
-    uint8_t modifiers, prior_modifiers, keycode;
-
-    // input = get_keyboard_input();
-    // modifiers = input & 0xFF;
-
-    // if (input != 0x00) {
-    //     for (int i = 2; i < 8; i++) {
-    //         keycode = (input >> (i << 3)) & 0xFF;
-    //         if (keycode != 0x00) {
-    //             if (keyboard_state[keycode] == 0) {
-    //                 keyboard_state[keycode] = 0b01;
-
-    //                 events[event_cnt].modifiers = modifiers;
-    //                 events[event_cnt].keycode = keycode;
-    //                 events[event_cnt].flags.pressed = true;
-    //                 events[event_cnt].flags.released = false;
-
-    //                 event_cnt++;
-    //             } else {
-    //                 keyboard_state[keycode] |= 0b10;
-    //             }
-    //         }
-    //     }
-    // }
-    // if (prior != 0x00) {
-    //     for (int i = 2; i < 8; i++) {
-    //         keycode = (prior >> (i << 3)) & 0xFF;
-    //         if (keycode != 0x00) {
-    //             if ((keyboard_state[keycode] & 0b11) == 0b01) {
-    //                 keyboard_state[keycode] = 0b00;
-
-    //                 events[event_cnt].modifiers = prior_modifiers;
-    //                 events[event_cnt].keycode = keycode;
-    //                 events[event_cnt].flags.pressed = false;
-    //                 events[event_cnt].flags.released = true;
-
-    //                 event_cnt++;
-    //             }
-    //             keyboard_state[keycode] &= ~0b10;
-    //         }
-    //     }
-    // }
-
-    // for (int i = 0; i < event_cnt; i++) {
-    //     event_handler->handle_event(KEYBOARD_EVENT, &events[i]);
-    // }
-
-    // prior = input;
-    // prior_modifiers = modifiers;
-    // event_cnt = 0;
-
-    // create_event(keyboard_loop);
-
-    while (1) {
-        input = get_keyboard_input();
-        modifiers = input & 0xFF;
-
-        if (input != 0x00) {
-            for (int i = 2; i < 8; i++) {
-                keycode = (input >> (i << 3)) & 0xFF;
-                if (keycode != 0x00) {
-                    if (keyboard_state[keycode] == 0) {
-                        keyboard_state[keycode] = 0b01;
-
-                        events[event_cnt].modifiers = modifiers;
-                        events[event_cnt].keycode = keycode;
-                        events[event_cnt].flags.pressed = true;
-                        events[event_cnt].flags.released = false;
-
-                        event_cnt++;
-                    } else {
-                        keyboard_state[keycode] |= 0b10;
-                    }
+    uint8_t modifiers, keycode;
+
+    uint64_t input = get_keyboard_input();
+    modifiers = input & 0xFF;
+
+    if (input != 0x00) {
+        for (int i = 2; i < 8; i++) {
+            keycode = (input >> (i << 3)) & 0xFF;
+            if (keycode != 0x00) {
+                if (keyboard_state[keycode] == 0) {
+                    keyboard_state[keycode] = 0b01;
+
+                    events[event_cnt].modifiers = modifiers;
+                    events[event_cnt].keycode = keycode;
+                    events[event_cnt].flags.pressed = true;
+                    events[event_cnt].flags.released = false;
+
+                    event_cnt++;
+                } else {
+                    keyboard_state[keycode] |= 0b10;
                 }
             }
         }
-        if (prior != 0x00) {
-            for (int i = 2; i < 8; i++) {
-                keycode = (prior >> (i << 3)) & 0xFF;
-                if (keycode != 0x00) {
-                    if ((keyboard_state[keycode] & 0b11) == 0b01) {
-                        keyboard_state[keycode] = 0b00;
-
-                        events[event_cnt].modifiers = prior_modifiers;
-                        events[event_cnt].keycode = keycode;
-                        events[event_cnt].flags.pressed = false;
-                        events[event_cnt].flags.released = true;
-
-                        event_cnt++;
-                    }
-                    keyboard_state[keycode] &= ~0b10;
+    }
+    if (prior != 0x00) {
+        for (int i = 2; i < 8; i++) {
+            keycode = (prior >> (i << 3)) & 0xFF;
+            if (keycode != 0x00) {
+                if ((keyboard_state[keycode] & 0b11) == 0b01) {
+                    keyboard_state[keycode] = 0b00;
+
+                    events[event_cnt].modifiers = prior_modifiers;
+                    events[event_cnt].keycode = keycode;
+                    events[event_cnt].flags.pressed = false;
+                    events[event_cnt].flags.released = true;
+
+                    event_cnt++;
                 }
+                keyboard_state[keycode] &= ~0b10;
             }
         }
+    }
 
-        for (int i = 0; i < event_cnt; i++) {
-            event_handler->handle_event(KEYBOARD_EVENT, &events[i]);
-        }
-
-        prior = input;
-        prior_modifiers = modifiers;
-        event_cnt = 0;
+    for (int i = 0; i < event_cnt; i++) {
+        event_handler->handle_event(KEYBOARD_EVENT, &events[i]);
     }
+
+    prior = input;
+    prior_modifiers = modifiers;
+
+    create_event_after(KEYBOARD_POLL_US, keyboard_poll);
+}
+
+void keyboard_loop() {
+    for (int i = 0; i < 256; i++) keyboard_state[i] = 0x00;
+    prior = 0;
+    prior_modifiers = 0;
+    keyboard_poll();
 }
@@ -0,0 +1,196 @@
+#include "lock_profile.h"
+
+#include "atomic.h"
+#include "libk.h"
+#include "percpu.h"
+#include "printf.h"
+#include "timer.h"
+
+#ifdef LOCK_PROFILE
+
+struct LockProfileTable {
+    LockProfileStats slots[LOCK_PROFILE_SLOTS];
+    uint64_t dropped;  // events for locks that found the table full
+};
+
+static PerCPU<LockProfileTable> tables;
+
+static const void* nameLocks[LOCK_PROFILE_NAMES];
+static const char* names[LOCK_PROFILE_NAMES];
+static Atomic<uint32_t> nameCount(0);
+
+// merged view for the report, only one core should report at a time
+static LockProfileStats merged[LOCK_PROFILE_SLOTS * CORE_COUNT];
+
+void lock_profile_name(const void* lock, const char* name) {
+    uint32_t i = nameCount.fetch_add(1, MemoryOrder::relaxed);
+    if (i >= LOCK_PROFILE_NAMES) {
+        return;
+    }
+    names[i] = name;
+    nameLocks[i] = lock;
+}
+
+static const char* name_of(const void* lock) {
+    uint32_t n = nameCount.get();
+    if (n > LOCK_PROFILE_NAMES) n = LOCK_PROFILE_NAMES;
+    for (uint32_t i = 0; i < n; i++) {
+        if (nameLocks[i] == lock) return names[i];
+    }
+    return nullptr;
+}
+
+static int bucket_of(uint64_t ticks) {
+    int b = 0;
+    while (ticks > 1 && b < LOCK_PROFILE_BUCKETS - 1) {
+        ticks >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/**
+ * open addressing on the lock address, callers have interrupts masked so an
+ * irq on this core can not race us for a slot
+ */
+static LockProfileStats* slot_for(LockProfileTable& table, const void* lock) {
+    uint64_t h = ((uint64_t)lock >> 3) * 0x9E3779B97F4A7C15ull;
+    uint32_t start = h >> 58;  // top 6 bits, LOCK_PROFILE_SLOTS == 64
+    for (uint32_t i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+        LockProfileStats* s = &table.slots[(start + i) % LOCK_PROFILE_SLOTS];
+        if (s->lock == lock) return s;
+        if (s->lock == nullptr) {
+            s->lock = lock;
+            return s;
+        }
+    }
+    table.dropped++;
+    return nullptr;
+}
+
+void lock_profile_acquired(const void* lock, bool contended, uint64_t wait_ticks) {
+    bool was = Interrupts::disable();
+    LockProfileStats* s = slot_for(tables.mine(), lock);
+    if (s != nullptr) {
+        s->acquires++;
+        if (contended) {
+            s->contended++;
+            s->wait_ticks += wait_ticks;
+            if (wait_ticks > s->max_wait) s->max_wait = wait_ticks;
+            s->wait_hist[bucket_of(wait_ticks)]++;
+        }
+    }
+    Interrupts::restore(was);
+}
+
+void lock_profile_released(const void* lock, uint64_t hold_ticks) {
+    bool was = Interrupts::disable();
+    LockProfileStats* s = slot_for(tables.mine(), lock);
+    if (s != nullptr) {
+        s->releases++;
+        s->hold_ticks += hold_ticks;
+        if (hold_ticks > s->max_hold) s->max_hold = hold_ticks;
+        s->hold_hist[bucket_of(hold_ticks)]++;
+    }
+    Interrupts::restore(was);
+}
+
+static void merge_into(LockProfileStats& to, const LockProfileStats& from) {
+    to.acquires += from.acquires;
+    to.contended += from.contended;
+    to.wait_ticks += from.wait_ticks;
+    to.releases += from.releases;
+    to.hold_ticks += from.hold_ticks;
+    if (from.max_wait > to.max_wait) to.max_wait = from.max_wait;
+    if (from.max_hold > to.max_hold) to.max_hold = from.max_hold;
+    for (int b = 0; b < LOCK_PROFILE_BUCKETS; b++) {
+        to.wait_hist[b] += from.wait_hist[b];
+        to.hold_hist[b] += from.hold_hist[b];
+    }
+}
+
+static void print_hist(const char* label, const uint32_t* hist) {
+    printf("    %s log2 ticks:", label);
+    for (int b = 0; b < LOCK_PROFILE_BUCKETS; b++) {
+        printf(" %d", hist[b]);
+    }
+    printf("\n");
+}
+
+/**
+ * racy snapshot of every core's table, good enough for a report. Locks are
+ * ranked by total wait time, then by contended acquires.
+ */
+void lock_profile_report(int top_n) {
+    int count = 0;
+    uint64_t dropped = 0;
+    K::memset(merged, 0, sizeof(merged));
+    for (int core = 0; core < CORE_COUNT; core++) {
+        LockProfileTable& table = tables.forCPU(core);
+        dropped += table.dropped;
+        for (int i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+            const LockProfileStats& s = table.slots[i];
+            if (s.lock == nullptr) continue;
+            int j = 0;
+            while (j < count && merged[j].lock != s.lock) j++;
+            if (j == count) {
+                merged[count++].lock = s.lock;
+            }
+            merge_into(merged[j], s);
+        }
+    }
+
+    printf("lock contention report, top %d of %d locks\n", top_n, count);
+    for (int rank = 0; rank < top_n && rank < count; rank++) {
+        // selection sort, the table is small and this is a debug path
+        int best = rank;
+        for (int j = rank + 1; j < count; j++) {
+            if (merged[j].wait_ticks > merged[best].wait_ticks ||
+                (merged[j].wait_ticks == merged[best].wait_ticks &&
+                 merged[j].contended > merged[best].contended)) {
+                best = j;
+            }
+        }
+        LockProfileStats tmp = merged[rank];
+        merged[rank] = merged[best];
+        merged[best] = tmp;
+
+        LockProfileStats& s = merged[rank];
+        const char* name = name_of(s.lock);
+        if (name != nullptr) {
+            printf("%d. %s\n", rank + 1, name);
+        } else {
+            printf("%d. lock 0x%x\n", rank + 1, (uint64_t)s.lock);
+        }
+        printf("    %d acquires, %d contended, wait %dus (max %dus), hold %dus (max %dus)\n",
+               s.acquires, s.contended, ticks_to_us(s.wait_ticks), ticks_to_us(s.max_wait),
+               ticks_to_us(s.hold_ticks), ticks_to_us(s.max_hold));
+        print_hist("wait", s.wait_hist);
+        print_hist("hold", s.hold_hist);
+    }
+    if (dropped != 0) {
+        printf("%d events dropped, a per-core table was full\n", dropped);
+    }
+}
+
+void lock_profile_reset() {
+    for (int core = 0; core < CORE_COUNT; core++) {
+        bool was = Interrupts::disable();
+        K::memset(&tables.forCPU(core), 0, sizeof(LockProfileTable));
+        Interrupts::restore(was);
+    }
+}
+
+#else
+
+void lock_profile_name(const void*, const char*) {
+}
+
+void lock_profile_report(int) {
+    printf("lock profiling is not compiled in, build with LOCK_PROFILE=1\n");
+}
+
+void lock_profile_reset() {
+}
+
+#endif /* LOCK_PROFILE */
@@ -20,41 +20,48 @@ static volatile int unbacked_id = 1;
  *         and should be released by the continuation function
  */
 void load_location(PageLocation* location, Function<void(uint64_t)> w) {
+    load_location_async(location).done([w](uint64_t paddr) { create_event(w, paddr); });
+}
+
+/**
+ * load_location as a future, an unbacked page completes without ever leaving
+ * the calling event
+ */
+Future<uint64_t> load_location_async(PageLocation* location) {
     K::assert(location != nullptr, "we are null location");
     K::assert(!location->present, "we are trying to load an already loaded page");
 
-    alloc_frame(PINNED_PAGE_FLAG, location, [=](uint64_t paddr) {
+    return alloc_frame_async(PINNED_PAGE_FLAG, location).then([=](uint64_t paddr) {
         void* page_vaddr = (void*)paddr_to_vaddr(paddr);
 
         if (location->location_type == UNBACKED) { /* not backed page */
             K::memset(page_vaddr, 0, PAGE_SIZE);  // dont give non zero memory
             location->present = true;
             location->paddr = paddr;
-            create_event(w, paddr);
-            return;
+            return make_ready_future(paddr);
         } else if (location->location_type == SWAP) { /* backed page*/
-            swap->read_swap(location->location.swap->swap_id, page_vaddr, [=]() {
-                location->present = true;
-                location->paddr = paddr;
-                create_event(w, paddr);
-                return;
-            });
+            return swap->read_swap_async(location->location.swap->swap_id, page_vaddr)
+                .then([=](Unit) {
+                    location->present = true;
+                    location->paddr = paddr;
+                    return make_ready_future(paddr);
+                });
         } else if (location->location_type == FILESYSTEM) {
             FileLocation* file_location = location->location.filesystem;
-            kread(file_location->file, file_location->offset, (char*)page_vaddr, PAGE_SIZE,
-                  [=](int ret) {
-                      K::assert(ret >= 0, "mmap: read failed\n");
-                      location->paddr = paddr;
-                      location->present = true;
-
-                      create_event(w, paddr);
-                  });
-
-        } else {
-            K::assert(false, "invalid location type");
+            return make_future<int>([=](Function<void(int)> read_done) {
+                       kread(file_location->file, file_location->offset, (char*)page_vaddr,
+                             PAGE_SIZE, read_done);
+                   })
+                .then([=](int ret) {
+                    K::assert(ret >= 0, "mmap: read failed\n");
+                    location->paddr = paddr;
+                    location->present = true;
+                    return make_ready_future(paddr);
+                });
         }
+        K::assert(false, "invalid location type");
+        return Promise<uint64_t>().get_future();
     });
-    return;
 }
 
 void create_local_mapping(PCB* pcb, uint64_t uvaddr, int prot, int flags, KFile* file,
@@ -132,43 +139,44 @@ void mmap_page(PCB* pcb, uint64_t uvaddr, int prot, int flags, KFile* file, uint
  * can be evicted (on not based off use case).
  */
 void load_mmapped_page(PCB* pcb, uint64_t uvaddr, Function<void(uint64_t)> w) {
+    load_mmapped_page_async(pcb, uvaddr).done([w](uint64_t kvaddr) { create_event(w, kvaddr); });
+}
+
+/**
+ * load_mmapped_page as a future. Every step runs inline in whoever completes
+ * the previous one, the only waits are contended locks and disk reads. The
+ * future holds 0 if uvaddr was never mapped.
+ */
+Future<uint64_t> load_mmapped_page_async(PCB* pcb, uint64_t uvaddr) {
     K::assert(uvaddr % PAGE_SIZE == 0, "invalid user vaddr passed to mmap");
+    SupplementalPageTable* supp_page_table = pcb->supp_page_table;
 
-    pcb->supp_page_table->lock.lock([=]() {
-        LocalPageLocation* local = pcb->supp_page_table->vaddr_mapping(uvaddr);
-        // K::assert(local != nullptr, "page being loaded has not been mmapped.");
+    // shared, faults on other pages only serialise on their own PageLocation
+    return acquire_shared(supp_page_table->lock).then([=](Unit) {
+        LocalPageLocation* local = supp_page_table->vaddr_mapping(uvaddr);
         if (local == nullptr) {
-            pcb->supp_page_table->lock.unlock();
-            create_event(w, (uint64_t)0);
-            return;
+            supp_page_table->lock.unlock_shared();
+            return make_ready_future((uint64_t)0);
         }
 
         PageLocation* location = local->location;
 
-        location->lock.lock([=]() {
-            if (!location->present) {
-                load_location(location, [=](uint64_t paddr) {
-                    pcb->page_table->map_vaddr(uvaddr, paddr, build_page_attributes(local), [=]() {
+        return acquire(location->lock).then([=](Unit) {
+            auto map_page = [=](uint64_t paddr) {
+                return pcb->page_table->map_vaddr_async(uvaddr, paddr, build_page_attributes(local))
+                    .then([=](Unit) {
                         location->lock.unlock();
-                        pcb->supp_page_table->lock.unlock();
-                        create_event(w, paddr_to_vaddr(paddr));
+                        supp_page_table->lock.unlock_shared();
+                        return make_ready_future(paddr_to_vaddr(paddr));
                     });
-                });
-                return;
-            } else {
+            };
+            if (location->present) {
                 pin_frame(location->paddr);
-                pcb->page_table->map_vaddr(uvaddr, location->paddr, build_page_attributes(local),
-                                           [=]() {
-                                               location->lock.unlock();
-                                               pcb->supp_page_table->lock.unlock();
-                                               create_event(w, paddr_to_vaddr(location->paddr));
-                                           });
-                return;
+                return map_page(location->paddr);
             }
+            return load_location_async(location).then(map_page);
         });
-        return;
     });
-    return;
 }
 
 /**
@@ -1,8 +1,10 @@
+#include "epoch.h"
 #include "event.h"
 #include "frame.h"
 #include "mmap.h"
 #include "printf.h"
 #include "swap.h"
+#include "timer.h"
 #include "sys.h"
 #include "trap_frame.h"
 
@@ -22,6 +24,7 @@ void handle_permissions_fault(KernelEntryFrame* trap_frame, uint64_t esr, uint64
 
 extern "C" void page_fault_handler(KernelEntryFrame* trap_frame, uint64_t esr, uint64_t elr,
                                    uint64_t spsr, uint64_t far) {
+    epoch_enter(getCoreID());
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     save_user_context(tcb, trap_frame);
 
@@ -58,9 +61,53 @@ extern "C" void page_fault_handler(KernelEntryFrame* trap_frame, uint64_t esr, u
     K::assert(false, "Shouldnt Get Here\n");
 }
 
+// per-core fault accounting, the core that finishes a fault records it
+uint64_t faultCount[CORE_COUNT] = {0};
+uint64_t faultTicks[CORE_COUNT] = {0};
+uint64_t faultAllocBaseline = 0;
+
+/**
+ * the faulting thread can run again, record how long the fault took
+ */
+void finish_fault(UserTCB* tcb, uint64_t start) {
+    int me = getCoreID();
+    faultCount[me]++;
+    faultTicks[me] += get_ticks() - start;
+    queue_user_tcb(tcb);
+}
+
+void reset_page_fault_stats() {
+    for (int core = 0; core < CORE_COUNT; core++) {
+        faultCount[core] = 0;
+        faultTicks[core] = 0;
+    }
+    faultAllocBaseline = heap_allocation_count();
+}
+
+/**
+ * average fault latency, and kmalloc calls per fault since the last reset.
+ * The allocation figure counts the whole system so it is only meaningful
+ * while a fault heavy test is the only thing running.
+ */
+void print_page_fault_stats() {
+    uint64_t faults = 0;
+    uint64_t ticks = 0;
+    for (int core = 0; core < CORE_COUNT; core++) {
+        faults += faultCount[core];
+        ticks += faultTicks[core];
+    }
+    if (faults == 0) {
+        printf("no page faults recorded\n");
+        return;
+    }
+    uint64_t allocs = heap_allocation_count() - faultAllocBaseline;
+    printf("%d page faults, %dus average, %d allocations per fault\n", faults,
+           ticks_to_us(ticks) / faults, allocs / faults);
+}
+
 void handle_translation_fault(KernelEntryFrame* trap_frame, uint64_t esr, uint64_t elr,
                               uint64_t spsr, uint64_t far) {
-    uint64_t user_sp = get_sp_el0();
+    uint64_t start = get_ticks();
 
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     save_user_context(tcb, trap_frame);
@@ -70,21 +117,27 @@ void handle_translation_fault(KernelEntryFrame* trap_frame, uint64_t esr, uint64
         event_loop();
     }
 
+    /* the lookup can finish on another core, send the rest of the fault back here */
+    int home = getCoreID();
+    uint64_t page = far & (~0xFFF);
+
     /* try loading in the page*/
-    load_mmapped_page(tcb->pcb, far & (~0xFFF), [=](uint64_t kvaddr) {
-        if (kvaddr == 0) { /* page isnt mapped */
-            /* map it as a new swap page (stack growth) and load it in */
-            mmap_page(tcb->pcb, far & (~0xFFF), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
-                      nullptr, 0, 0, [=]() {
-                          load_mmapped_page(tcb->pcb, far & (~0xFFF), [=](uint64_t kvaddr) {
+    load_mmapped_page_async(tcb->pcb, page).done([=](uint64_t kvaddr) {
+        if (kvaddr != 0) { /* page is mapped and now loaded into memory, unpin and requeue */
+            unpin_frame(vaddr_to_paddr(kvaddr));
+            finish_fault(tcb, start);
+            return;
+        }
+        /* page isnt mapped, map it as a new swap page (stack growth) and load it in */
+        create_event_on(home, [=]() {
+            mmap_page(tcb->pcb, page, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, nullptr,
+                      0, 0, [=]() {
+                          load_mmapped_page_async(tcb->pcb, page).done([=](uint64_t kvaddr) {
                               unpin_frame(vaddr_to_paddr(kvaddr));
-                              queue_user_tcb(tcb);
+                              finish_fault(tcb, start);
                           });
                       });
-        } else { /* page is mapped and now loaded into memory, unpin and requeu*/
-            unpin_frame(kvaddr);
-            queue_user_tcb(tcb);
-        }
+        });
     });
 
     event_loop();
@@ -92,62 +145,72 @@ void handle_translation_fault(KernelEntryFrame* trap_frame, uint64_t esr, uint64
 
 void handle_permissions_fault(KernelEntryFrame* trap_frame, uint64_t esr, uint64_t elr,
                               uint64_t spsr, uint64_t far) {
-    uint64_t user_sp = get_sp_el0();
+    uint64_t start = get_ticks();
 
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     PCB* pcb = tcb->pcb;
+    uint64_t page = far & ~0xFFF;
 
     save_user_context(tcb, trap_frame);
 
-    pcb->supp_page_table->lock.lock([=]() {
-        LocalPageLocation* local = pcb->supp_page_table->vaddr_mapping(far & ~0xFFF);
+    acquire_shared(pcb->supp_page_table->lock).done([=](Unit) {
+        LocalPageLocation* local = pcb->supp_page_table->vaddr_mapping(page);
         PageLocation* location = local->location;
 
         /* check if we actually have write permisisons on the page */
         if ((local->perm & WRITE_PERM == 0 && (esr >> 6) & 0x1) || (local->perm & READ_PERM == 0)) {
-            pcb->supp_page_table->lock.unlock();
+            pcb->supp_page_table->lock.unlock_shared();
             kill_process(pcb);
             event_loop();
         }
 
-        pcb->supp_page_table->lock.unlock();
-        /* load the page we faulted on into memory */
-        load_mmapped_page(pcb, far & ~0xFFF, [=](uint64_t kvaddr_old) {
-            location->lock.lock([=]() {
+        pcb->supp_page_table->lock.unlock_shared();
+
+        /* load the page we faulted on into memory, then hold its location */
+        load_mmapped_page_async(pcb, page)
+            .then([=](uint64_t kvaddr_old) {
+                return acquire(location->lock).then(
+                    [=](Unit) { return make_ready_future(kvaddr_old); });
+            })
+            .done([=](uint64_t kvaddr_old) {
                 /* if we are the only user and NOT a private filesys page we can just use it */
                 if (location->ref_count == 1 && location->location_type != FILESYSTEM) {
                     unpin_frame(vaddr_to_paddr(kvaddr_old));
-                    queue_user_tcb(tcb);
                     location->lock.unlock();
+                    finish_fault(tcb, start);
                     return;
-                } else { /* copy on write */
-                    /* create a new local mapping to replace with */
-                    LocalPageLocation* new_local =
-                        new LocalPageLocation(pcb, local->perm, local->sharing_mode, local->uvaddr);
-
-                    swap->get_swap_id([=](uint64_t new_id) {
-                        page_cache->get_or_add(
-                            nullptr, 0, new_id, new_local, [=](PageLocation* new_location) {
-                                /* replace mapping with new local */
-                                pcb->supp_page_table->map_vaddr(new_local->uvaddr, new_local);
-                                load_mmapped_page(pcb, far & ~0xFFF, [=](uint64_t kvaddr_new) {
-                                    /* copy the old page to the new page */
-                                    memcpy((void*)kvaddr_new, (void*)kvaddr_old, PAGE_SIZE);
-
-                                    /* unpin both pages */
-                                    unpin_frame(vaddr_to_paddr(kvaddr_new));
-                                    unpin_frame(vaddr_to_paddr(kvaddr_old));
-
-                                    /* delete the old page mapping impliciptly releases lock*/
-                                    page_cache->remove(local, [=]() { delete local; });
-
-                                    queue_user_tcb(tcb);
-                                });
+                }
+
+                /* copy on write, create a new local mapping to replace with */
+                LocalPageLocation* new_local =
+                    new LocalPageLocation(pcb, local->perm, local->sharing_mode, local->uvaddr);
+
+                swap->get_swap_id_async()
+                    .then([=](uint64_t new_id) {
+                        return make_future<PageLocation*>(
+                            [=](Function<void(PageLocation*)> added) {
+                                page_cache->get_or_add(nullptr, 0, new_id, new_local, added);
                             });
+                    })
+                    .then([=](PageLocation* new_location) {
+                        /* replace mapping with new local */
+                        pcb->supp_page_table->map_vaddr(new_local->uvaddr, new_local);
+                        return load_mmapped_page_async(pcb, page);
+                    })
+                    .done([=](uint64_t kvaddr_new) {
+                        /* copy the old page to the new page */
+                        memcpy((void*)kvaddr_new, (void*)kvaddr_old, PAGE_SIZE);
+
+                        /* unpin both pages */
+                        unpin_frame(vaddr_to_paddr(kvaddr_new));
+                        unpin_frame(vaddr_to_paddr(kvaddr_old));
+
+                        /* delete the old page mapping impliciptly releases lock*/
+                        page_cache->remove(local, [=]() { delete local; });
+
+                        finish_fault(tcb, start);
                     });
-                }
             });
-        });
     });
     event_loop();
-}
\ No newline at end of file
+}
@@ -289,6 +289,7 @@ void tfp_format(void* putp, void (*putf)(void*, char), const char* fmt, va_list
 void init_printf(void* putp, void (*putf)(void*, char)) {
     stdout_putf = putf;
     stdout_putp = putp;
+    lock_profile_name(&printf_lock, "printf");
 }
 
 static void putcp(void* p, char c) {
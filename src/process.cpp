@@ -1,13 +1,21 @@
 #include "process.h"
 
+#include "epoch.h"
 #include "printf.h"
 #include "tty.h"
 
+// parent links and child lists, so an exiting parent and an exiting child
+// agree on who reaps the child
+static SpinLock tree_lock;
+
 void fork(struct UserTCB* tcb) {
     PCB* child_pcb = new PCB();
     child_pcb->frameBuffer = request_tty();
     child_pcb->data_end = tcb->pcb->data_end;
-    tcb->pcb->add_child(child_pcb);
+    {
+        LockGuard<SpinLock> g{tree_lock};
+        tcb->pcb->add_child(child_pcb);
+    }
     child_pcb->supp_page_table->copy_mappings(tcb->pcb->supp_page_table, child_pcb, [=]() {
         UserTCB* child_tcb = new UserTCB();
         child_tcb->pcb = child_pcb;
@@ -23,7 +31,106 @@ void fork(struct UserTCB* tcb) {
     });
 }
 
+void exit_process(struct PCB* pcb, int status) {
+    PCB* parent;
+    {
+        // a child either sees its parent gone or has its SIGCHLD queued
+        // before the drain below
+        LockGuard<SpinLock> g{tree_lock};
+        // orphan the child processes
+        for (PCB* start = pcb->child_start; start != nullptr; start = start->next) {
+            start->parent = nullptr;
+        }
+        parent = pcb->parent;
+        if (parent != nullptr) {
+            // throw signals at parent processes
+            parent->remove_child(pcb);
+            parent->raise_signal(new Signal(SIGCHLD, pcb->pid, status));
+        }
+    }
+    // children that exited without being waited for
+    while (Signal* s = pcb->take_child_signal()) {
+        reap_child(s->from_pid);
+        delete s;
+    }
+    if (parent == nullptr) {
+        retire_task(pcb);
+        return;
+    }
+    if (pcb->waiting_parent) {
+        printf("sema is not null for %d\n", pcb->pid);
+        pcb->waiting_parent->up();
+    } else {
+        printf("sema is null for %d\n", pcb->pid);
+    }
+}
+
+void reap_child(int pid) {
+    PCB* child = task_lookup(pid);
+    if (child == nullptr) {
+        return;
+    }
+    // the semaphore is the parent's, shared by every child it waited on
+    child->waiting_parent = nullptr;
+    retire_task(child);
+}
+
 void kill_process(struct PCB* pcb) {
     Signal* s = new Signal(SIGKILL, -1, -1);
-    pcb->sigs->add(s);
-}
\ No newline at end of file
+    send_signal(pcb, s);
+}
+
+void send_signal(struct PCB* target, Signal* s) {
+    switch (s->val) {
+        case SIGSTOP:
+            target->stop_requested = true;
+            delete s;
+            return;
+        case SIGCONT:
+            // clear before waking so a thread racing into sleep_if stays up
+            target->stop_requested = false;
+            target->stopped.wake_all();
+            delete s;
+            return;
+        case SIGKILL:
+            target->raise_signal(s);
+            target->stop_requested = false;
+            target->stopped.kill_all();
+            return;
+        default:
+            target->raise_signal(s);
+            return;
+    }
+}
+void publish_task(PCB* pcb) {
+    int count = __atomic_add_fetch(&task_cnt, 1, __ATOMIC_RELAXED);
+    K::assert(count <= NR_TASKS, "we are out of task space!\n");
+    int slot = curr_task;
+    while (true) {
+        PCB* expected = nullptr;
+        pcb->pid = slot;
+        // release, a lookup that finds pcb sees it fully built
+        if (__atomic_compare_exchange_n(&task[slot], &expected, pcb, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+            curr_task = slot;
+            return;
+        }
+        slot = (slot + 1) % NR_TASKS;
+    }
+}
+
+void publish_task_at(PCB* pcb, int pid) {
+    __atomic_add_fetch(&task_cnt, 1, __ATOMIC_RELAXED);
+    pcb->pid = pid;
+    PCB* old = __atomic_exchange_n(&task[pid], pcb, __ATOMIC_ACQ_REL);
+    if (old != nullptr && old != pcb) {
+        epoch_retire(old);
+    }
+}
+
+void retire_task(PCB* pcb) {
+    PCB* self = pcb;
+    __atomic_compare_exchange_n(&task[pcb->pid], &self, nullptr, false, __ATOMIC_ACQ_REL,
+                                __ATOMIC_RELAXED);
+    epoch_retire(pcb);
+}
@@ -0,0 +1,161 @@
+#include "slab.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "libk.h"
+#include "lock_profile.h"
+#include "percpu.h"
+
+struct SlabCache {
+    memory_block_t* head = nullptr;  // free objects, linked through the header
+    uint32_t count = 0;
+};
+
+struct __attribute__((aligned(64))) SlabCore {
+    SlabCache classes[SLAB_CLASSES];
+    uint64_t allocations = 0;
+};
+
+// full batches handed back by cores that freed more than they allocate
+struct SlabDepot {
+    SpinLock lock;
+    memory_block_t* batches = nullptr;
+};
+
+static PerCPU<SlabCore> slabCores;
+static SlabDepot depots[SLAB_CLASSES];
+
+static const char* depotNames[SLAB_CLASSES] = {
+    "slab depot 16",  "slab depot 32",  "slab depot 64",   "slab depot 128",
+    "slab depot 256", "slab depot 512", "slab depot 1024", "slab depot 2048"};
+
+int slab_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+    // bits needed for size - 1, less the 4 SLAB_MIN_SIZE already covers
+    return 64 - __builtin_clzl(size - 1) - 4;
+}
+
+static size_t block_size(int cls) {
+    return sizeof(memory_block_t) + slab_class_size(cls);
+}
+
+static uint32_t batch_size(int cls) {
+    uint32_t batch = SLAB_CHUNK_BYTES / block_size(cls);
+    return batch < SLAB_MAX_BATCH ? batch : SLAB_MAX_BATCH;
+}
+
+// the depot links batches through the payload of their first object
+static memory_block_t*& next_batch(memory_block_t* block) {
+    return *(memory_block_t**)(block + 1);
+}
+
+/**
+ * carves a fresh batch out of the general heap, only happens while a class is
+ * growing
+ */
+static memory_block_t* carve_batch(int cls) {
+    size_t size = block_size(cls);
+    uint32_t batch = batch_size(cls);
+    char* chunk = (char*)heap_alloc(size * batch, SLAB_CHUNK);
+    K::memset(chunk, 0, size * batch);
+    memory_block_t* head = nullptr;
+    for (int i = batch - 1; i >= 0; i--) {
+        memory_block_t* block = (memory_block_t*)(chunk + i * size);
+        block->block_size_alloc = slab_class_size(cls) | SLAB_BLOCK | 0x1;
+        block->next = head;
+        head = block;
+    }
+    return head;
+}
+
+static void refill(int cls, SlabCache& cache) {
+    SlabDepot& depot = depots[cls];
+    memory_block_t* batch;
+    {
+        LockGuard<SpinLock> g{depot.lock};
+        batch = depot.batches;
+        if (batch != nullptr) {
+            depot.batches = next_batch(batch);
+        }
+    }
+    if (batch == nullptr) {
+        batch = carve_batch(cls);
+    } else {
+        next_batch(batch) = nullptr;  // payloads are handed out zeroed
+    }
+    cache.head = batch;
+    cache.count = batch_size(cls);
+}
+
+/**
+ * hands a batch to the depot, the object freed last stays since it is the
+ * likeliest to still be in this core's cache
+ */
+static void drain(int cls, SlabCache& cache) {
+    uint32_t batch_count = batch_size(cls);
+    memory_block_t* keep = cache.head;
+    memory_block_t* batch = keep->next;
+    memory_block_t* last = batch;
+    for (uint32_t i = 1; i < batch_count; i++) {
+        last = last->next;
+    }
+    keep->next = last->next;
+    cache.count -= batch_count;
+    last->next = nullptr;
+
+    SlabDepot& depot = depots[cls];
+    LockGuard<SpinLock> g{depot.lock};
+    next_batch(batch) = depot.batches;
+    depot.batches = batch;
+}
+
+void slab_init() {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        lock_profile_name(&depots[cls].lock, depotNames[cls]);
+    }
+}
+
+void* slab_alloc(size_t size) {
+    int cls = slab_class(size);
+    bool was = Interrupts::disable();
+    SlabCore& core = slabCores.mine();
+    SlabCache& cache = core.classes[cls];
+    if (cache.head == nullptr) {
+        refill(cls, cache);
+    }
+    memory_block_t* block = cache.head;
+    cache.head = block->next;
+    cache.count--;
+    core.allocations++;
+    Interrupts::restore(was);
+    block->next = nullptr;
+    return block + 1;
+}
+
+void slab_free(void* ptr) {
+    memory_block_t* block = (memory_block_t*)ptr - 1;
+    size_t size = block->block_size_alloc & ~(ALIGNMENT - 1);
+    K::memset(ptr, 0, size);
+    int cls = slab_class(size);
+
+    bool was = Interrupts::disable();
+    SlabCache& cache = slabCores.mine().classes[cls];
+    block->next = cache.head;
+    cache.head = block;
+    cache.count++;
+    if (cache.count > 2 * batch_size(cls)) {
+        drain(cls, cache);
+    }
+    Interrupts::restore(was);
+}
+
+// racy snapshot, only used for statistics
+uint64_t slab_allocation_count() {
+    uint64_t total = 0;
+    for (int core = 0; core < CORE_COUNT; core++) {
+        total += slabCores.forCPU(core).allocations;
+    }
+    return total;
+}
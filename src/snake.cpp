@@ -1,6 +1,7 @@
 #include "snake.h"
 
 #include "dwc.h"
+#include "event.h"
 #include "framebuffer.h"
 #include "libk.h"
 #include "listener.h"
@@ -137,19 +138,25 @@ void reset() {
     init_snake();
 }
 
+/**
+ * one frame per timer event instead of spinning in wait_msec, the core is
+ * free for other work between frames
+ */
+void snake_frame() {
+    if (tick(&state) || render(&state)) {
+        reset();
+        return;
+    }
+    create_event_after(1000000 / FPS, snake_frame);
+}
+
 void init_snake() {
     init();
     fb_pitch = fb_get()->pitch >> 2;
     fb_size = fb_get()->size;
     fb_buffer = (uint32_t *)fb_get()->buffer;
 
-    while (1) {
-        if (tick(&state) || render(&state)) {
-            break;
-        }
-        wait_msec(1000000 / FPS);
-    }
-    reset();
+    create_event_after(1000000 / FPS, snake_frame);
 }
 
 int main() {
@@ -47,6 +47,29 @@ void Swap::read_swap(uint64_t swap_id, void* kvaddr, Function<void(void)> w) {
     });
 }
 
+/**
+ * read_swap as a future, the read itself is synchronous so this only waits if
+ * the swap lock is contended
+ */
+Future<Unit> Swap::read_swap_async(uint64_t swap_id, void* kvaddr) {
+    return acquire(*lock).then([=](Unit) {
+        long sector = swap_id_to_sector(swap_id);
+        if (sector == -1) {
+            K::memset(kvaddr, 0, PAGE_SIZE);
+        } else {
+            sector = (uint32_t)sector;
+            int ret = sd_read_block(sector, (unsigned char*)kvaddr, 8);
+            if (ret != PAGE_SIZE) {
+                K::assert(false, "");
+            }
+            bitmap->free(sector_to_sector_index(sector));
+            map->remove(swap_id);
+        }
+        lock->unlock();
+        return make_ready_future(Unit{});
+    });
+}
+
 /**
  * removes and frees swap_id if it is currently stored in swap
  */
@@ -71,6 +94,14 @@ void Swap::get_swap_id(Function<void(uint64_t)> w) {
     });
 }
 
+Future<uint64_t> Swap::get_swap_id_async() {
+    return acquire(*lock).then([=](Unit) {
+        uint64_t swap_id = unused_ids++;
+        lock->unlock();
+        return make_ready_future(swap_id);
+    });
+}
+
 /**
  * swap id, to the physical sector where the page is stored
  */
@@ -2,17 +2,22 @@
 
 #include "../filesystem/filesys/fs_requests.h"
 #include "../user_programs/system_calls.h"
+#include "alloc_profile.h"
 #include "atomic.h"
 #include "elf_loader.h"
+#include "epoch.h"
 #include "event.h"
 #include "file_table.h"
 #include "framebuffer.h"
 #include "fs.h"
+#include "lock_profile.h"
 #include "mmap.h"
 #include "printf.h"
 #include "process.h"
 #include "ramfs.h"
 #include "stdint.h"
+#include "timer.h"
+#include "timer_wheel.h"
 #include "tty.h"
 #include "utils.h"
 #include "vm.h"
@@ -36,9 +41,13 @@ int newlib_handle_unlink(KernelEntryFrame* frame);
 int newlib_handle_wait(KernelEntryFrame* frame);
 void newlib_handle_write(KernelEntryFrame* frame);
 int newlib_handle_time(KernelEntryFrame* frame);
+void newlib_handle_nanosleep(KernelEntryFrame* frame);
+void newlib_handle_usleep(KernelEntryFrame* frame);
 int newlib_handle_sbrk(KernelEntryFrame* frame);
 int newlib_handle_mmap(KernelEntryFrame* frame);
 int newlib_handle_time_elapsed(KernelEntryFrame* frame);
+int sys_sched_priority(KernelEntryFrame* frame);
+int sys_profile_report(KernelEntryFrame* frame);
 
 
 void handle_newlib_syscall(int opcode, KernelEntryFrame* frame);
@@ -65,6 +74,7 @@ int sys_draw_frame(KernelEntryFrame* frame);
 
 void syscall_handler(KernelEntryFrame* frame) {
     // printf("hello\n");
+    epoch_enter(getCoreID());
     int opcode = frame->X[8];
     if (opcode == DRAW_FRAME) {
         frame->X[0] = sys_draw_frame(frame);
@@ -139,6 +149,12 @@ void handle_newlib_syscall(int opcode, KernelEntryFrame* frame) {
         case NEWLIB_TIME:
             frame->X[0] = newlib_handle_time(frame);
             break;
+        case NEWLIB_NANOSLEEP:
+            newlib_handle_nanosleep(frame);
+            break;
+        case NEWLIB_USLEEP:
+            newlib_handle_usleep(frame);
+            break;
         case NEWLIB_SBRK:
             newlib_handle_sbrk(frame);
             break;
@@ -148,6 +164,12 @@ void handle_newlib_syscall(int opcode, KernelEntryFrame* frame) {
         case NEWLIB_TIME_ELAPSED:
             frame->X[0] = newlib_handle_time_elapsed(frame);
             break;
+        case SCHED_PRIORITY:
+            frame->X[0] = sys_sched_priority(frame);
+            break;
+        case PROFILE_REPORT:
+            frame->X[0] = sys_profile_report(frame);
+            break;
         default:
             break;
     }
@@ -167,23 +189,7 @@ void handle_linux_syscall(int opcode, KernelEntryFrame* frame) {
 void newlib_handle_exit(KernelEntryFrame* frame) {
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     printf("exit has ran, returning %d\n", frame->X[0]);
-    if (tcb->pcb->parent != nullptr) {
-        // throw signals at parent processes
-        Signal* s = new Signal(SIGCHLD, tcb->pcb->pid, frame->X[0]);
-        tcb->pcb->parent->remove_child(tcb->pcb);
-        tcb->pcb->parent->raise_signal(s);
-
-        if (tcb->pcb->waiting_parent) {
-            printf("sema is not null for %d\n", tcb->pcb->pid);
-            tcb->pcb->waiting_parent->up();
-        } else {
-            printf("sema is null for %d\n", tcb->pcb->pid);
-        }
-    }
-    // orphan the child processes
-    for (PCB* start = tcb->pcb->child_start; start != nullptr; start = start->next) {
-        start->parent = nullptr;
-    }
+    exit_process(tcb->pcb, frame->X[0]);
     delete tcb;
     event_loop();
 }
@@ -290,19 +296,24 @@ int newlib_handle_isatty(KernelEntryFrame* frame) {
 int newlib_handle_kill(KernelEntryFrame* frame) {
     int pid = frame->X[0];
     int sig = frame->X[1];
+    // the pending mask has one bit per signal, anything past it is not a signal
+    if (sig <= 0 || sig >= 32) {
+        printf("invalid signal %d\n", sig);
+        return 1;
+    }
     if (pid < 1) {
         printf("dont have process groups implemented\n");
         return 1;
     } else {
         UserTCB* tcb = get_running_user_tcb(getCoreID());
         int curr_pid = tcb->pcb->pid;
-        PCB* target = task[pid];
+        PCB* target = task_lookup(pid);
         if (target == nullptr) {
             printf("invalid pid\n");
             return 1;
         }
         Signal* s = new Signal(sig, curr_pid, 0);
-        target->sigs->add(s);
+        send_signal(target, s);
     }
     return 0;
 }
@@ -461,22 +472,18 @@ int newlib_handle_wait(KernelEntryFrame* frame) {
     bool terminated = false;
     // check among existing signals if it already has an exited child or if this is a terminated
     // process
-    while (true) {
-        sig = tcb->pcb->sigs->remove();
-        if (sig == nullptr) break;
-        if (sig->val == SIGKILL) {
-            terminated = true;
-            break;
-        }
-        if (sig->val == SIGCHLD) {
-            cur->page_table->use_page_table();
-            *status_location = sig->status;
-            n_pid = sig->from_pid;
-            break;
-        }
+    if (cur->signal_pending(SIGKILL)) {
+        terminated = true;
+    } else if (sig = cur->take_child_signal()) {
+        cur->page_table->use_page_table();
+        *status_location = sig->status;
+        n_pid = sig->from_pid;
+        reap_child(n_pid);
+        delete sig;
     }
     if (terminated) {
-        tcb->state = TASK_KILLED;
+        exit_process(cur, -1);
+        delete tcb;
         event_loop();
     } else if (n_pid != -1) {
         // child already terminated
@@ -498,17 +505,14 @@ int newlib_handle_wait(KernelEntryFrame* frame) {
         Signal* sig;
         int n_pid = -1;
         bool terminated = false;
-        while (sig = (tcb->pcb->sigs->remove())) {
-            if (sig->val == SIGKILL) {
-                terminated = true;
-                break;
-            }
-            if (sig->val == SIGCHLD) {
-                cur->page_table->use_page_table();
-                *status_location = sig->status;
-                n_pid = sig->from_pid;
-                break;
-            }
+        if (cur->signal_pending(SIGKILL)) {
+            terminated = true;
+        } else if (sig = cur->take_child_signal()) {
+            cur->page_table->use_page_table();
+            *status_location = sig->status;
+            n_pid = sig->from_pid;
+            reap_child(n_pid);
+            delete sig;
         }
         if (n_pid == -1) {
             printf("no SIGCHLD signal - something's wrong\n");
@@ -523,11 +527,62 @@ int newlib_handle_wait(KernelEntryFrame* frame) {
     return 0;
 }
 
+// layouts of newlib's struct timeval and struct timespec on aarch64
+struct user_timeval {
+    int64_t tv_sec;
+    int64_t tv_usec;
+};
+
+struct user_timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+};
+
+/**
+ * gettimeofday, there is no real time clock so the epoch is boot
+ */
 int newlib_handle_time(KernelEntryFrame* frame) {
-    // TODO: Implement time.
+    user_timeval* tv = (user_timeval*)frame->X[0];
+    if (tv != nullptr) {
+        uint64_t now = get_systime();
+        tv->tv_sec = now / 1000000;
+        tv->tv_usec = now % 1000000;
+    }
     return 0;
 }
 
+/**
+ * parks the calling thread on this core's timer wheel, it is queued again
+ * with the usual mlfq wakeup boost once the time is up
+ */
+void sleep_user_tcb(KernelEntryFrame* frame, uint64_t us) {
+    UserTCB* tcb = get_running_user_tcb(getCoreID());
+    save_user_context(tcb, frame);
+    set_return_value(tcb, 0);
+    timer_wheel_sleep(tcb, us);
+    event_loop();
+}
+
+void newlib_handle_nanosleep(KernelEntryFrame* frame) {
+    const user_timespec* req = (const user_timespec*)frame->X[0];
+    user_timespec* rem = (user_timespec*)frame->X[1];
+    if (req == nullptr || req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+        frame->X[0] = -1;
+        return;
+    }
+    uint64_t us = req->tv_sec * 1000000 + (req->tv_nsec + 999) / 1000;
+    // signals never cut a sleep short, so nothing is ever left over
+    if (rem != nullptr) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    sleep_user_tcb(frame, us);
+}
+
+void newlib_handle_usleep(KernelEntryFrame* frame) {
+    sleep_user_tcb(frame, frame->X[0]);
+}
+
 int newlib_handle_sbrk(KernelEntryFrame* frame) {
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     printf("called sbrk with %d\n", frame->X[0]);
@@ -596,4 +651,64 @@ int sys_draw_frame(KernelEntryFrame* frame) {
 }int newlib_handle_time_elapsed(KernelEntryFrame* frame) {
     UserTCB* tcb = get_running_user_tcb(getCoreID());
     return get_systime() - tcb->pcb->start_time;
-}
\ No newline at end of file
+}
+
+/**
+ * reads a process's mlfq level or reads/sets its nice value, pid 0 means the
+ * caller. Nice is clamped to [NICE_MIN, NICE_MAX] and takes effect the next
+ * time the process is queued.
+ */
+int sys_sched_priority(KernelEntryFrame* frame) {
+    int pid = frame->X[0];
+    int op = frame->X[1];
+    int value = frame->X[2];
+
+    PCB* target = get_running_user_tcb(getCoreID())->pcb;
+    if (pid != 0) {
+        target = task_lookup(pid);
+        if (target == nullptr) {
+            return -1;
+        }
+    }
+
+    switch (op) {
+        case SCHED_GET_PRIORITY:
+            return target->effective_priority();
+        case SCHED_GET_NICE:
+            return target->nice;
+        case SCHED_SET_NICE:
+            if (value < NICE_MIN) value = NICE_MIN;
+            if (value > NICE_MAX) value = NICE_MAX;
+            target->nice = value;
+            return value;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * prints a profiling report on demand, builds without the profiler compiled
+ * in just say so
+ */
+int sys_profile_report(KernelEntryFrame* frame) {
+    int op = frame->X[0];
+    int top_n = frame->X[1];
+    uint64_t min_age_us = frame->X[2];
+
+    switch (op) {
+        case PROFILE_LOCKS:
+            lock_profile_report(top_n);
+            return 0;
+        case PROFILE_LOCKS_RESET:
+            lock_profile_reset();
+            return 0;
+        case PROFILE_ALLOCS:
+            alloc_profile_report(top_n, min_age_us);
+            return 0;
+        case PROFILE_ALLOCS_RESET:
+            alloc_profile_reset();
+            return 0;
+        default:
+            return -1;
+    }
+}
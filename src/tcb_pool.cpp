@@ -0,0 +1,100 @@
+#include "tcb_pool.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "percpu.h"
+
+struct PoolNode {
+    PoolNode* next;
+    PoolNode* next_batch;  // only valid for the first node of a batch in the depot
+};
+
+struct __attribute__((aligned(64))) PoolCache {
+    PoolNode* head = nullptr;
+    uint32_t count = 0;
+};
+
+static PerCPU<PoolCache> caches;
+
+// full batches handed back by cores that freed more than they allocate
+static SpinLock depot_lock;
+static PoolNode* depot = nullptr;
+
+/**
+ * carves a fresh batch out of the heap, only happens while the pool is growing
+ */
+static PoolNode* carve_batch() {
+    char* chunk = (char*)kmalloc(TCB_POOL_OBJECT_SIZE * TCB_POOL_BATCH);
+    PoolNode* head = nullptr;
+    for (int i = TCB_POOL_BATCH - 1; i >= 0; i--) {
+        PoolNode* node = (PoolNode*)(chunk + i * TCB_POOL_OBJECT_SIZE);
+        node->next = head;
+        head = node;
+    }
+    return head;
+}
+
+static void refill(PoolCache& cache) {
+    PoolNode* batch;
+    {
+        LockGuard<SpinLock> g{depot_lock};
+        batch = depot;
+        if (batch != nullptr) {
+            depot = batch->next_batch;
+        }
+    }
+    if (batch == nullptr) {
+        batch = carve_batch();
+    }
+    cache.head = batch;
+    cache.count = TCB_POOL_BATCH;
+}
+
+static void drain(PoolCache& cache) {
+    PoolNode* batch = cache.head;
+    PoolNode* last = batch;
+    for (int i = 1; i < TCB_POOL_BATCH; i++) {
+        last = last->next;
+    }
+    cache.head = last->next;
+    cache.count -= TCB_POOL_BATCH;
+    last->next = nullptr;
+
+    LockGuard<SpinLock> g{depot_lock};
+    batch->next_batch = depot;
+    depot = batch;
+}
+
+void* tcb_pool_alloc(size_t size) {
+    if (size > TCB_POOL_OBJECT_SIZE) {
+        return kmalloc(size);
+    }
+    bool was = Interrupts::disable();
+    PoolCache& cache = caches.mine();
+    if (cache.head == nullptr) {
+        refill(cache);
+    }
+    PoolNode* node = cache.head;
+    cache.head = node->next;
+    cache.count--;
+    Interrupts::restore(was);
+    return node;
+}
+
+void tcb_pool_free(void* ptr, size_t size) {
+    if (ptr == nullptr) return;
+    if (size > TCB_POOL_OBJECT_SIZE) {
+        kfree(ptr);
+        return;
+    }
+    bool was = Interrupts::disable();
+    PoolCache& cache = caches.mine();
+    PoolNode* node = (PoolNode*)ptr;
+    node->next = cache.head;
+    cache.head = node;
+    cache.count++;
+    if (cache.count > TCB_POOL_MAX_CACHED) {
+        drain(cache);
+    }
+    Interrupts::restore(was);
+}
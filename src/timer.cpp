@@ -3,6 +3,7 @@
 #include "irq.h"
 #include "peripherals/arm_devices.h"
 #include "printf.h"
+#include "timer.h"
 #include "utils.h"
 
 const unsigned int interval = 200000;
@@ -15,23 +16,30 @@ void timer_init(void) {
 }
 
 void local_timer_init() {
-    QA7->TimerRouting.Routing = LOCALTIMER_TO_CORE0_IRQ;  // Route local timer IRQ to Core0
-    QA7->TimerControlStatus.ReloadValue = 10000000;       // Timer period set
-    QA7->TimerControlStatus.TimerEnable = 1;              // Timer enabled
-    QA7->TimerControlStatus.IntEnable = 1;                // Timer IRQ enabled
-    QA7->TimerClearReload.IntClear = 1;                   // Clear interrupt
-    QA7->TimerClearReload.Reload = 1;                     // Reload now
+    // preemption runs off each core's own CNTP timer, keep the shared local timer quiet
+    QA7->TimerControlStatus.TimerEnable = 0;
+    QA7->TimerControlStatus.IntEnable = 0;
+    QA7->TimerClearReload.IntClear = 1;
 
     // We are in NS EL1 so enable IRQ to core0 that level
     // Make sure FIQ is zero, if set irq is ignored
+    // CNTP preempts user threads, CNTV drives each core's timer wheel
     QA7->Core0TimerIntControl.nCNTPNSIRQ_IRQ = 1;
     QA7->Core0TimerIntControl.nCNTPNSIRQ_FIQ = 0;
+    QA7->Core0TimerIntControl.nCNTVIRQ_IRQ = 1;
+    QA7->Core0TimerIntControl.nCNTVIRQ_FIQ = 0;
     QA7->Core1TimerIntControl.nCNTPNSIRQ_IRQ = 1;
     QA7->Core1TimerIntControl.nCNTPNSIRQ_FIQ = 0;
+    QA7->Core1TimerIntControl.nCNTVIRQ_IRQ = 1;
+    QA7->Core1TimerIntControl.nCNTVIRQ_FIQ = 0;
     QA7->Core2TimerIntControl.nCNTPNSIRQ_IRQ = 1;
     QA7->Core2TimerIntControl.nCNTPNSIRQ_FIQ = 0;
+    QA7->Core2TimerIntControl.nCNTVIRQ_IRQ = 1;
+    QA7->Core2TimerIntControl.nCNTVIRQ_FIQ = 0;
     QA7->Core3TimerIntControl.nCNTPNSIRQ_IRQ = 1;
     QA7->Core3TimerIntControl.nCNTPNSIRQ_FIQ = 0;
+    QA7->Core3TimerIntControl.nCNTVIRQ_IRQ = 1;
+    QA7->Core3TimerIntControl.nCNTVIRQ_FIQ = 0;
 
     // set up mailbox
     QA7->Core0MailboxIntControl.Mailbox0_IRQ = 1;
@@ -78,4 +86,53 @@ uint64_t get_systime() {
     asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
     asm volatile("mrs %0, cntpct_el0" : "=r"(t));
     return (t * 1000000) / f;
-}
\ No newline at end of file
+}
+
+/**
+ * raw generic timer count, cheap enough for hot path accounting
+ */
+uint64_t get_ticks() {
+    uint64_t t;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(t));
+    return t;
+}
+
+/**
+ * converts a difference of get_ticks() values into microseconds
+ */
+uint64_t ticks_to_us(uint64_t ticks) {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return (ticks * 1000000) / f;
+}
+
+volatile uint64_t preemptQuantumUs = PREEMPT_QUANTUM_US;
+
+void set_preempt_quantum(uint64_t us) {
+    preemptQuantumUs = us;
+}
+
+uint64_t get_preempt_quantum() {
+    return preemptQuantumUs;
+}
+
+/**
+ * starts a fresh time slice on this core, the CNTP interrupt fires once the
+ * quantum runs out
+ */
+void arm_preempt_timer() {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    uint64_t ticks = (f / 1000000) * preemptQuantumUs;
+    asm volatile("msr cntp_tval_el0, %0" ::"r"(ticks));
+    asm volatile("msr cntp_ctl_el0, %0" ::"r"((uint64_t)1));  // enabled, not masked
+    asm volatile("isb");
+}
+
+/**
+ * the CNTP interrupt is level triggered, disabling the timer also drops it
+ */
+void disarm_preempt_timer() {
+    asm volatile("msr cntp_ctl_el0, %0" ::"r"((uint64_t)0));
+    asm volatile("isb");
+}
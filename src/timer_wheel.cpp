@@ -0,0 +1,188 @@
+#include "timer_wheel.h"
+
+#include "event.h"
+#include "percpu.h"
+
+PerCPU<TimerWheel> timerWheel;
+
+TimerWheel::TimerWheel() : now(0), count(0) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            slots[level][slot] = nullptr;
+        }
+    }
+}
+
+/**
+ * files tcb on the lowest level whose span covers its remaining delay. Delays
+ * past the top level park in its furthest slot and get filed again when that
+ * slot cascades.
+ */
+void TimerWheel::place(TCB* tcb) {
+    uint64_t expires = tcb->wake_tick;
+    uint64_t delta = expires - now;
+    uint64_t span = 1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= span) {
+        expires = now + span - 1;
+        delta = span - 1;
+    }
+
+    int level = 0;
+    while (delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    tcb->next = slots[level][slot];
+    slots[level][slot] = tcb;
+}
+
+// moves the current slot of level down into the levels below it
+void TimerWheel::cascade(int level) {
+    uint32_t slot = (now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    TCB* it = slots[level][slot];
+    slots[level][slot] = nullptr;
+    while (it != nullptr) {
+        TCB* next = it->next;
+        place(it);
+        it = next;
+    }
+}
+
+void TimerWheel::add(TCB* tcb) {
+    // the current tick has already been processed
+    if (tcb->wake_tick <= now) {
+        tcb->wake_tick = now + 1;
+    }
+    place(tcb);
+    count++;
+}
+
+/**
+ * earliest tick at which a level 0 slot fires or a non-empty slot above it
+ * cascades, nothing on the wheel can expire before then
+ */
+uint64_t TimerWheel::next_expiry() {
+    uint64_t best = (uint64_t)-1;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        uint64_t base = now >> shift;
+        for (uint64_t d = 1; d <= TIMER_WHEEL_SLOTS; d++) {
+            if (slots[level][(base + d) & TIMER_WHEEL_MASK] != nullptr) {
+                uint64_t tick = (base + d) << shift;
+                if (tick < best) best = tick;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+TCB* TimerWheel::advance(uint64_t until) {
+    TCB* expired = nullptr;
+    while (now < until) {
+        if (count == 0) {
+            now = until;
+            break;
+        }
+        // ticks with nothing to fire or cascade are skipped outright
+        uint64_t next = next_expiry();
+        if (next > until) {
+            now = until;
+            break;
+        }
+        now = next;
+
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((now >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) {
+                break;
+            }
+            cascade(level);
+        }
+
+        uint32_t slot = now & TIMER_WHEEL_MASK;
+        TCB* it = slots[0][slot];
+        slots[0][slot] = nullptr;
+        while (it != nullptr) {
+            TCB* next_tcb = it->next;
+            it->next = expired;
+            expired = it;
+            count--;
+            it = next_tcb;
+        }
+    }
+    return expired;
+}
+
+static uint64_t counts_per_tick() {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return (f / 1000000) * TIMER_WHEEL_TICK_US;
+}
+
+// the wheel runs off the virtual count so it matches the CNTV comparator
+uint64_t timer_wheel_now() {
+    uint64_t t;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t / counts_per_tick();
+}
+
+uint64_t us_to_wheel_ticks(uint64_t us) {
+    return (us + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+}
+
+/**
+ * fires once the virtual count reaches tick, a tick already in the past fires
+ * straight away so a late arm never loses a wakeup
+ */
+static void arm_wheel_timer(uint64_t tick) {
+    uint64_t cval = tick * counts_per_tick();
+    asm volatile("msr cntv_cval_el0, %0" ::"r"(cval));
+    asm volatile("msr cntv_ctl_el0, %0" ::"r"((uint64_t)1));  // enabled, not masked
+    asm volatile("isb");
+}
+
+static void disarm_wheel_timer() {
+    asm volatile("msr cntv_ctl_el0, %0" ::"r"((uint64_t)0));
+    asm volatile("isb");
+}
+
+static void requeue(TCB* tcb) {
+    tcb->next = nullptr;
+    if (tcb->kernel_event) {
+        queue_on_core(tcb, resolve_core(tcb->home_core), KERNEL_PRIORITY);
+    } else {
+        queue_user_tcb((UserTCB*)tcb);
+    }
+}
+
+void timer_wheel_sleep(TCB* tcb, uint64_t delay_us) {
+    if (delay_us == 0) {
+        requeue(tcb);
+        return;
+    }
+    bool was = Interrupts::disable();
+    TimerWheel& wheel = timerWheel.mine();
+    uint64_t now = timer_wheel_now();
+    if (wheel.empty()) {
+        wheel.advance(now);  // an idle wheel just jumps forward
+    }
+    // +1 because the current tick is already partly over
+    tcb->wake_tick = now + us_to_wheel_ticks(delay_us) + 1;
+    wheel.add(tcb);
+    arm_wheel_timer(wheel.next_expiry());
+    Interrupts::restore(was);
+}
+
+void timer_wheel_irq() {
+    TimerWheel& wheel = timerWheel.mine();
+    disarm_wheel_timer();
+    TCB* expired = wheel.advance(timer_wheel_now());
+    while (expired != nullptr) {
+        TCB* next = expired->next;
+        requeue(expired);
+        expired = next;
+    }
+    if (!wheel.empty()) {
+        arm_wheel_timer(wheel.next_expiry());
+    }
+}
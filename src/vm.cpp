@@ -189,6 +189,68 @@ void PageTable::map_vaddr_pmd(pud_t* pmd, uint64_t vaddr, uint64_t paddr, uint64
     }
 }
 
+/**
+ * returns the table the descriptor points at, allocating and linking a zeroed
+ * one if there is none yet. Faults on other pages of the same process only
+ * hold the supplemental page table shared, so the new table is linked with a
+ * CAS and the loser of a race frees its frame and uses the winner's table.
+ */
+Future<PageTableLevel*> PageTable::table_at(uint64_t* descriptor, uint64_t page_attributes) {
+    uint64_t seen = __atomic_load_n(descriptor, __ATOMIC_ACQUIRE);
+    PageTableLevel* table = descriptor_to_vaddr(seen);
+    if (table != nullptr) {
+        return make_ready_future(table);
+    }
+    return alloc_frame_async(PINNED_PAGE_FLAG, nullptr).then([=](uint64_t table_paddr) mutable {
+        K::assert(table_paddr != nullptr, "palloc failed");
+        PageTableLevel* table = (PageTableLevel*)paddr_to_vaddr(table_paddr);
+        K::memset((void*)table, 0, PAGE_SIZE);
+        uint64_t linked = paddr_to_table_descriptor(table_paddr, page_attributes);
+        if (!__atomic_compare_exchange_n(descriptor, &seen, linked, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            unpin_frame(table_paddr);
+            free_frame(table_paddr);
+            return make_ready_future(descriptor_to_vaddr(seen));
+        }
+        return make_ready_future(table);
+    });
+}
+
+Future<Unit> PageTable::map_vaddr_async(uint64_t vaddr, uint64_t paddr, uint64_t page_attributes) {
+    K::assert((paddr & 0xFFF) == 0, "non-aligned paddr for va to pa mapping");
+    K::assert((vaddr & 0xFFF) == 0, "non-aligned vaddr for va to pa mappin");
+    Future<Unit> has_pgd =
+        this->pgd != nullptr
+            ? make_ready_future(Unit{})
+            : alloc_frame_async(PINNED_PAGE_FLAG, nullptr).then([this](uint64_t paddr) {
+                  K::assert(paddr != nullptr, "palloc failed");
+                  pgd_t* fresh = (pgd_t*)paddr_to_vaddr(paddr);
+                  K::memset((void*)fresh, 0, PAGE_SIZE);
+                  // same race as table_at
+                  pgd_t* expected = nullptr;
+                  if (!__atomic_compare_exchange_n(&this->pgd, &expected, fresh, false,
+                                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                      unpin_frame(paddr);
+                      free_frame(paddr);
+                  }
+                  return make_ready_future(Unit{});
+              });
+    return has_pgd
+        .then([=](Unit) {
+            return table_at(&pgd->descriptors[get_pgd_index(vaddr)], page_attributes);
+        })
+        .then([=](pud_t* pud) {
+            return table_at(&pud->descriptors[get_pud_index(vaddr)], page_attributes);
+        })
+        .then([=](pmd_t* pmd) {
+            return table_at(&pmd->descriptors[get_pmd_index(vaddr)], page_attributes);
+        })
+        .then([=](pte_t* pte) {
+            map_vaddr_pte(pte, vaddr, paddr, page_attributes);
+            return make_ready_future(Unit{});
+        });
+}
+
 void PageTable::map_vaddr_pte(pud_t* pte, uint64_t vaddr, uint64_t paddr,
                               uint64_t page_attributes) {
     uint64_t pte_index = get_pte_index(vaddr);
@@ -465,6 +527,7 @@ void PageCache::remove(LocalPageLocation* local, Function<void(void)> w) {
 
 void init_page_cache() {
     page_cache = new PageCache;
+    lock_profile_name(&page_cache->lock, "PageCache::lock");
 }
 
 void init_swap() {
@@ -487,7 +550,7 @@ PageLocation::~PageLocation() {
 
 void SupplementalPageTable::copy_mappings(SupplementalPageTable* other, PCB* pcb,
                                           Function<void(void)> w) {
-    other->lock.lock([=]() {
+    other->lock.lock_shared([=]() {
         this->lock.lock([=]() {
             Semaphore* sema = new Semaphore((-other->map.size) + 1);
             other->map.for_each([=](LocalPageLocation* local) {
@@ -514,7 +577,7 @@ void SupplementalPageTable::copy_mappings(SupplementalPageTable* other, PCB* pcb
             sema->down([=]() {
                 delete sema;
                 this->lock.unlock();
-                other->lock.unlock();
+                other->lock.unlock_shared();
                 create_event(w);
             });
         });
@@ -0,0 +1,95 @@
+#include "wait_queue.h"
+
+#include "event.h"
+
+void WaitQueue::add(TCB* tcb) {
+    tcb->next = nullptr;
+    if (first == nullptr) {
+        first = tcb;
+    } else {
+        last->next = tcb;
+    }
+    last = tcb;
+    count++;
+}
+
+UserTCB* WaitQueue::remove() {
+    TCB* it = first;
+    if (it == nullptr) {
+        return nullptr;
+    }
+    first = it->next;
+    if (first == nullptr) {
+        last = nullptr;
+    }
+    count--;
+    return (UserTCB*)it;
+}
+
+void WaitQueue::sleep(UserTCB* tcb) {
+    LockGuard<InterruptSafeLock> guard(lock);
+    tcb->state = TASK_STOPPED;
+    add(tcb);
+}
+
+bool WaitQueue::sleep_if(UserTCB* tcb, volatile bool& condition) {
+    LockGuard<InterruptSafeLock> guard(lock);
+    if (!condition) {
+        return false;
+    }
+    tcb->state = TASK_STOPPED;
+    add(tcb);
+    return true;
+}
+
+bool WaitQueue::wake_one() {
+    UserTCB* tcb;
+    {
+        LockGuard<InterruptSafeLock> guard(lock);
+        tcb = remove();
+    }
+    if (tcb == nullptr) {
+        return false;
+    }
+    tcb->state = TASK_RUNNING;
+    queue_user_tcb(tcb);
+    return true;
+}
+
+uint32_t WaitQueue::wake_all() {
+    TCB* list;
+    {
+        LockGuard<InterruptSafeLock> guard(lock);
+        list = first;
+        first = last = nullptr;
+        count = 0;
+    }
+    uint32_t woken = 0;
+    while (list != nullptr) {
+        UserTCB* tcb = (UserTCB*)list;
+        list = list->next;
+        tcb->state = TASK_RUNNING;
+        queue_user_tcb(tcb);
+        woken++;
+    }
+    return woken;
+}
+
+uint32_t WaitQueue::kill_all() {
+    TCB* list;
+    {
+        LockGuard<InterruptSafeLock> guard(lock);
+        list = first;
+        first = last = nullptr;
+        count = 0;
+    }
+    uint32_t killed = 0;
+    while (list != nullptr) {
+        UserTCB* tcb = (UserTCB*)list;
+        list = list->next;
+        tcb->state = TASK_KILLED;
+        queue_user_tcb(tcb);
+        killed++;
+    }
+    return killed;
+}
@@ -5,5 +5,10 @@
 
 long time_elapsed();
 int  sys_draw_frame(void * rendered_frame);
+// op is one of the SCHED_* operations in system_calls.h, pid 0 is the caller
+long sched_priority(int pid, int op, int value);
+// op is one of the PROFILE_* operations in system_calls.h, min_age_us only
+// matters for PROFILE_ALLOCS
+long profile_report(int op, long top_n, long min_age_us);
 
 #endif
\ No newline at end of file
@@ -20,6 +20,8 @@
 #define NEWLIB_WAIT 15
 #define NEWLIB_WRITE 16
 #define NEWLIB_TIME 17
+#define NEWLIB_NANOSLEEP 18
+#define NEWLIB_USLEEP 19
 #define NEWLIB_MMAP 42
 #define NEWLIB_SBRK 999
 
@@ -27,6 +29,21 @@
 
 #define DRAW_FRAME 64
 #define NEWLIB_TIME_ELAPSED 21 
+#define SCHED_PRIORITY 22
+
+// operations for SCHED_PRIORITY
+#define SCHED_GET_PRIORITY 0
+#define SCHED_GET_NICE 1
+#define SCHED_SET_NICE 2
+
+// prints a kernel profiling report over the uart
+#define PROFILE_REPORT 23
+
+// operations for PROFILE_REPORT
+#define PROFILE_LOCKS 0  // lock contention, the top_n locks by wait time
+#define PROFILE_LOCKS_RESET 1
+#define PROFILE_ALLOCS 2  // the top_n call sites by live bytes
+#define PROFILE_ALLOCS_RESET 3
 
 
 // TODO: Later, add Linux system call #'s here.